@@ -3,11 +3,20 @@ from Cython.Distutils import build_ext
 from version import get_git_version
 import sys
 
+# The flags the Makefile builds libbdelta.cpp with, which needs C++11 and
+# threads.  The module is C++ throughout so that they apply to all of it.
+if sys.platform == 'win32':
+	compile_args, link_args = ['/EHsc'], []
+else:
+	compile_args = ['-std=c++11', '-pthread', '-D_FILE_OFFSET_BITS=64']
+	link_args = ['-pthread']
+
 bdelta_module = Extension(
 	"bdelta",
 	["src/bdelta.pyx", "src/libbdelta.cpp"],
-	define_macros = [('TOKEN_SIZE', '2')],
-	extra_compile_args = ['/EHsc'] if sys.platform == 'win32' else None
+	language = 'c++',
+	extra_compile_args = compile_args,
+	extra_link_args = link_args
 )
 
 setup(
@@ -5,18 +5,29 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
+#include <string>
 
 #include "bdelta.h"
 #include "file.h"
+#include "codec.h"
+#include "patch.h"
 #include "compatibility.h"
 
-const void *f_read(void *f, void *buf, unsigned place, unsigned num) {
-	fseek((FILE *)f, place, SEEK_SET);
+const void *f_read(void *f, void *buf, uint64_t place, unsigned num) {
+	fseek64((FILE *)f, place, SEEK_SET);
 	fread_fixed((FILE *)f, buf, num);
 	return buf;
 }
 
-const void *m_read(void *f, void * buf, unsigned place, unsigned num) {
+// Lets the kernel read ahead of f_read, where the passes read in order.
+void f_prefetch(void *f, uint64_t place, unsigned num) {
+#ifdef BDELTA_HAVE_FADVISE
+	posix_fadvise(fileno((FILE *)f), place, num, POSIX_FADV_WILLNEED);
+#endif
+}
+
+const void *m_read(void *f, void * buf, uint64_t place, unsigned num) {
 	if (0) {
 		/*
 		 * BDelta uses only returned pointer
@@ -30,53 +41,704 @@ const void *m_read(void *f, void * buf, unsigned place, unsigned num) {
 	return (const char*)f + place;
 }
 
-void my_pass(BDelta_Instance *b, unsigned blocksize, unsigned minMatchSize, unsigned flags) {
-	bdelta_pass(b, blocksize, minMatchSize, 0, flags);
-	bdelta_clean_matches(b, BDELTA_REMOVE_OVERLAP);
+// Files read as one input, their concatenation, with c_read(): the
+// references given with --ref.  Each file is mapped if map is set, and
+// read through stdio otherwise, which can't serve several threads.
+struct Concatenation {
+	std::vector<FILE *> files;
+	std::vector<const char *> maps; // NULL where read through stdio
+	std::vector<uint64_t> sizes, ends; // ends[i] is just past file i
+
+	void add(FILE *f, uint64_t size, const char *map) {
+		files.push_back(f);
+		maps.push_back(map);
+		sizes.push_back(size);
+		ends.push_back((ends.empty() ? 0 : ends.back()) + size);
+	}
+	uint64_t size() const {return ends.empty() ? 0 : ends.back();}
+	bool mapped() const {return std::find(maps.begin(), maps.end(), (const char *)NULL) == maps.end();}
+	// Closes and unmaps the files.
+	void close() {
+		for (size_t i = 0; i < files.size(); ++i) {
+			unmap_file(maps[i], sizes[i]);
+			fclose(files[i]);
+		}
+	}
+
+	// Calls f(i, offset, num) for each piece of [place, place + num) within
+	// file i, in order.
+	template <class F>
+	void each(uint64_t place, uint64_t num, F f) const {
+		size_t i = std::upper_bound(ends.begin(), ends.end(), place) - ends.begin();
+		for (; num; ++i) {
+			uint64_t start = i ? ends[i - 1] : 0,
+			         n = std::min(num, ends[i] - place);
+			f(i, place - start, n);
+			place += n;
+			num -= n;
+		}
+	}
+};
+
+const void *c_read(void *handle, void *buf, uint64_t place, unsigned num) {
+	const Concatenation &c = *(const Concatenation *)handle;
+	size_t i = std::upper_bound(c.ends.begin(), c.ends.end(), place) - c.ends.begin();
+	// Within one mapped file, the data is read in place.
+	if (i < c.maps.size() && c.maps[i] && place + num <= c.ends[i])
+		return c.maps[i] + (place - (i ? c.ends[i - 1] : 0));
+	char *out = (char *)buf;
+	c.each(place, num, [&](size_t i, uint64_t at, uint64_t n) {
+		if (c.maps[i])
+			memcpy(out, c.maps[i] + at, (size_t)n);
+		else
+			f_read(c.files[i], out, at, (unsigned)n);
+		out += n;
+	});
+	return buf;
+}
+
+void c_prefetch(void *handle, uint64_t place, unsigned num) {
+	const Concatenation &c = *(const Concatenation *)handle;
+	c.each(place, num, [&](size_t i, uint64_t at, uint64_t n) {
+		if (!c.maps[i]) f_prefetch(c.files[i], at, (unsigned)n);
+	});
+}
+
+// Parses a schedule of comma separated passes, each blocksize:minMatchSize
+// with an optional :maxHoleSize, followed by g for a global pass and/or o
+// for BDELTA_SIDES_ORDERED.  For example "997:1994,127:254,13:26g".
+bool parse_passes(const char *spec, unsigned flags, std::vector<BDelta_Pass> &passes) {
+	passes.clear();
+	while (*spec) {
+		BDelta_Pass p = {0, 0, 0, flags};
+		char *end;
+		p.blockSize = strtoul(spec, &end, 10);
+		if (end == spec || *end != ':' || !p.blockSize) return false;
+		spec = end + 1;
+		p.minMatchSize = strtoul(spec, &end, 10);
+		if (end == spec) return false;
+		spec = end;
+		if (*spec == ':') {
+			p.maxHoleSize = strtoul(++spec, &end, 10);
+			if (end == spec) return false;
+			spec = end;
+		}
+		for (; *spec && *spec != ','; ++spec) {
+			if (*spec == 'g') p.flags |= BDELTA_GLOBAL;
+			else if (*spec == 'o') p.flags |= BDELTA_SIDES_ORDERED;
+			else return false;
+		}
+		if (*spec == ',' && !*++spec) return false;
+		passes.push_back(p);
+	}
+	return !passes.empty();
+}
+
+// Copies a stream that can't be seeked, such as stdin, into an anonymous
+// temporary file, setting size to its length.  The passes read the new
+// file in every pass and the patch needs its unmatched data after that,
+// so it has to be kept whole; this keeps it on disk, where it is then
+// read in windows or mapped like any other input.
+FILE *spool_stream(FILE *in, uint64_t &size) {
+	FILE *f = tmpfile();
+	if (!f) throw "couldn't create a temporary file for the piped input";
+	size = 0;
+	std::vector<char> buf(1 << 20);
+	size_t n;
+	while ((n = fread(&buf[0], 1, buf.size(), in)) > 0) {
+		fwrite_fixed(f, &buf[0], n);
+		size += n;
+	}
+	if (ferror(in)) throw "read error: couldn't read piped input";
+	if (fflush(f)) throw "write error: could not write temporary data.  Possibly out of space";
+	rewind(f);
+	return f;
+}
+
+enum InputMode {INPUT_FILE, INPUT_RAM, INPUT_MMAP};
+
+// Appends s to out as a JSON string.
+void json_string(std::string &out, const char *s) {
+	out += '"';
+	for (; *s; ++s) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20) {
+			char buf[8];
+			snprintf(buf, sizeof(buf), "\\u%04x", c);
+			out += buf;
+		} else
+			out += c;
+	}
+	out += '"';
+}
+
+static void json_field(std::string &out, const char *name, uint64_t value, bool first = false) {
+	char buf[64];
+	snprintf(buf, sizeof(buf), "%s\"%s\": %llu", first ? "" : ", ", name, (unsigned long long)value);
+	out += buf;
+}
+static void json_seconds(std::string &out, const char *name, double value) {
+	char buf[64];
+	snprintf(buf, sizeof(buf), ", \"%s\": %.6f", name, value);
+	out += buf;
+}
+
+// The stats of b as a JSON object, for --stats.
+std::string stats_json(BDelta_Instance *b) {
+	BDelta_Stats st;
+	bdelta_get_stats(b, &st);
+	std::string out = "{";
+	json_field(out, "numPasses", st.numPasses, true);
+	json_field(out, "peakIndexBytes", st.peakIndexBytes);
+	json_field(out, "blocksIndexed", st.blocksIndexed);
+	json_field(out, "blocksSkipped", st.blocksSkipped);
+	json_field(out, "sampledPasses", st.sampledPasses);
+	json_field(out, "matchedTokens", st.matchedTokens);
+	out += ", \"passes\": [";
+	for (unsigned i = 0; i < st.numPasses; ++i) {
+		BDelta_PassStats ps;
+		bdelta_get_pass_stats(b, i, &ps);
+		out += i ? ",\n\t{" : "\n\t{";
+		json_field(out, "blockSize", ps.blockSize, true);
+		json_field(out, "flags", ps.flags);
+		json_field(out, "checksums", ps.checksums);
+		json_field(out, "dropped", ps.dropped);
+		json_field(out, "probes", ps.probes);
+		json_field(out, "hits", ps.hits);
+		json_field(out, "falseHits", ps.falseHits);
+		json_field(out, "comparedTokens", ps.comparedTokens);
+		json_field(out, "reads", ps.reads);
+		json_field(out, "readBytes", ps.readBytes);
+		json_field(out, "matchesAdded", ps.matchesAdded);
+		json_seconds(out, "buildSeconds", ps.buildSeconds);
+		json_seconds(out, "scanSeconds", ps.scanSeconds);
+		json_seconds(out, "sortSeconds", ps.sortSeconds);
+		json_seconds(out, "seconds", ps.seconds);
+		out += "}";
+	}
+	out += "]}";
+	return out;
+}
+
+// How patches are written, from the command line
+struct PatchOptions {
+	unsigned version;
+	int codec, codecLevel;
+	uint64_t chunkSize;
+	std::vector<uint64_t> refSizes; // With several references
+};
+
+// Writes the matches of b as a patch to path.  read and handle2 give the
+// new file's unmatched data.  Returns false if path can't be created.
+bool write_patch(BDelta_Instance *b, const char *path, uint64_t size, uint64_t size2,
+		patch_readCallback read, void *handle2, const PatchOptions &opts) {
+	FILE *fout = fopen(path, "wb");
+	if (!fout) return false;
+	unsigned nummatches = bdelta_numMatches(b);
+	PatchWriter patch(fout, size, size2, nummatches, read, handle2,
+		opts.version, opts.codec, opts.codecLevel, opts.chunkSize, opts.refSizes);
+	const unsigned chunk = 4096;
+	uint64_t p1[chunk], p2[chunk], num[chunk];
+	for (unsigned i = 0; i < nummatches; i += chunk) {
+		unsigned got = bdelta_getMatches64(b, i, chunk, p1, p2, num);
+		for (unsigned j = 0; j < got; ++j)
+			patch.addMatch(p1[j], p2[j], num[j]);
+	}
+	patch.finish();
+	fclose(fout);
+	return true;
+}
+
+// One line of a --batch manifest, and the state of its inputs while it runs.
+struct BatchJob {
+	std::string oldfile, newfile, patchfile;
+	uint64_t size, size2;
+	FILE *f1, *f2;
+	const char *m1, *m2;
+	bool mapped;
+	std::string error; // Set if the job failed
+	std::string stats; // JSON, with --stats
+};
+
+struct BatchRun {
+	std::vector<BatchJob> jobs;
+	InputMode mode;
+	int prepassBlocksize;
+	unsigned prepassMinMatch;
+	PatchOptions patchOptions;
+	bool wantStats;
+};
+
+// Reads a manifest of one job per line: old file, new file and patch file,
+// separated by tabs.  Blank lines and lines starting with # are skipped.
+bool read_manifest(const char *path, std::vector<BatchJob> &jobs) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		printf("couldn't open manifest: %s\n", path);
+		return false;
+	}
+	char line[4096 * 3];
+	unsigned lineNum = 0;
+	while (fgets(line, sizeof(line), f)) {
+		++lineNum;
+		line[strcspn(line, "\r\n")] = 0;
+		if (!line[0] || line[0] == '#') continue;
+		char *tab1 = strchr(line, '\t'), *tab2 = tab1 ? strchr(tab1 + 1, '\t') : NULL;
+		if (!tab2 || strchr(tab2 + 1, '\t')) {
+			printf("%s:%u: expected <oldfile> <newfile> <patchfile>, separated by tabs\n", path, lineNum);
+			fclose(f);
+			return false;
+		}
+		*tab1 = *tab2 = 0;
+		BatchJob job;
+		job.oldfile = line;
+		job.newfile = tab1 + 1;
+		job.patchfile = tab2 + 1;
+		if (!fileExists(job.oldfile.c_str()) || !fileExists(job.newfile.c_str())) {
+			printf("%s:%u: one of the input files does not exist\n", path, lineNum);
+			fclose(f);
+			return false;
+		}
+		job.size = getLenOfFile(job.oldfile.c_str());
+		job.size2 = getLenOfFile(job.newfile.c_str());
+		job.f1 = job.f2 = NULL;
+		job.m1 = job.m2 = NULL;
+		job.mapped = false;
+		jobs.push_back(job);
+	}
+	fclose(f);
+	return true;
+}
+
+static void close_inputs(BatchJob &job) {
+	if (job.mapped) {
+		unmap_file(job.m1, job.size);
+		unmap_file(job.m2, job.size2);
+	} else {
+		delete [] job.m1;
+		delete [] job.m2;
+	}
+	job.m1 = job.m2 = NULL;
+	if (job.f1) fclose(job.f1);
+	if (job.f2) fclose(job.f2);
+	job.f1 = job.f2 = NULL;
+}
+
+// BDelta_Batch callbacks.  They run on the batch's worker threads, so
+// errors are kept with the job rather than thrown.
+static int batch_open(void *context, unsigned jobNum, BDelta_Instance *b) {
+	BatchRun &run = *(BatchRun *)context;
+	BatchJob &job = run.jobs[jobNum];
+	try {
+		job.f1 = fopen(job.oldfile.c_str(), "rb");
+		job.f2 = fopen(job.newfile.c_str(), "rb");
+		if (!job.f1 || !job.f2) throw "couldn't open the input files";
+		if (run.mode == INPUT_FILE)
+			bdelta_reset(b, job.size, job.size2, job.f1, job.f2);
+		else {
+			if (run.mode == INPUT_MMAP) {
+				job.m1 = (const char *)map_file(job.f1, job.size);
+				job.m2 = (const char *)map_file(job.f2, job.size2);
+				job.mapped = job.m1 && job.m2;
+				if (!job.mapped) {
+					// Not mappable; the instance wants memory, so read them in.
+					unmap_file(job.m1, job.size);
+					unmap_file(job.m2, job.size2);
+				}
+			}
+			if (!job.mapped) {
+				char *r1 = new char[(size_t)job.size];
+				char *r2 = new char[(size_t)job.size2];
+				job.m1 = r1;
+				job.m2 = r2;
+				fread_fixed(job.f1, r1, job.size);
+				fread_fixed(job.f2, r2, job.size2);
+			}
+			bdelta_reset(b, job.size, job.size2, (void *)job.m1, (void *)job.m2);
+		}
+		if (run.prepassBlocksize >= 0)
+			bdelta_prepass(b, run.prepassBlocksize, run.prepassMinMatch);
+		return 0;
+	} catch (const char *desc) {
+		job.error = desc;
+	}
+	close_inputs(job);
+	return 1;
+}
+
+static void batch_done(void *context, unsigned jobNum, BDelta_Instance *b) {
+	BatchRun &run = *(BatchRun *)context;
+	BatchJob &job = run.jobs[jobNum];
+	try {
+		bool ok = run.mode == INPUT_FILE ?
+			write_patch(b, job.patchfile.c_str(), job.size, job.size2, f_read, job.f2, run.patchOptions) :
+			write_patch(b, job.patchfile.c_str(), job.size, job.size2, m_read, (void *)job.m2, run.patchOptions);
+		if (!ok) job.error = "couldn't open output file";
+		if (run.wantStats) job.stats = stats_json(b);
+	} catch (const char *desc) {
+		job.error = desc;
+	}
+	close_inputs(job);
+}
+
+// Diffs every job of a manifest on numThreads threads, one job per thread
+// at a time.  Returns the number of jobs that failed.
+unsigned run_batch(BatchRun &run, const std::vector<BDelta_Pass> &passes, const BDelta_PlanLimits &limits,
+		uint64_t memoryLimit, unsigned numThreads) {
+	std::vector<uint64_t> jobSizes;
+	for (size_t i = 0; i < run.jobs.size(); ++i)
+		jobSizes.push_back(run.jobs[i].size + run.jobs[i].size2);
+	std::vector<BDelta_Instance *> instances;
+	for (unsigned t = 0; t < numThreads; ++t) {
+		BDelta_Instance *b = run.mode == INPUT_FILE ?
+			bdelta_init_alg64(0, 0, f_read, NULL, NULL, 1) :
+			bdelta_init_mem(NULL, 0, NULL, 0, 1);
+		bdelta_set_memory_limit(b, memoryLimit);
+		if (run.mode == INPUT_FILE)
+			bdelta_set_prefetch(b, f_prefetch, 0);
+		instances.push_back(b);
+	}
+	BDelta_Batch batch = {(unsigned)run.jobs.size(), jobSizes.empty() ? NULL : &jobSizes[0],
+		batch_open, batch_done, &run};
+	bdelta_run_batch(&instances[0], numThreads, &batch, &passes[0], passes.size(), &limits);
+	for (unsigned t = 0; t < numThreads; ++t)
+		bdelta_done_alg(instances[t]);
+
+	unsigned failed = 0;
+	for (size_t i = 0; i < run.jobs.size(); ++i)
+		if (!run.jobs[i].error.empty()) {
+			fprintf(stderr, "FATAL: %s: %s\n", run.jobs[i].patchfile.c_str(), run.jobs[i].error.c_str());
+			++failed;
+		}
+	if (run.wantStats) {
+		// An array of each patch written and its stats, in manifest order
+		std::string out = "[";
+		for (size_t i = 0; i < run.jobs.size(); ++i) {
+			if (run.jobs[i].stats.empty()) continue;
+			out += out.size() > 1 ? ",\n{\"patch\": " : "\n{\"patch\": ";
+			json_string(out, run.jobs[i].patchfile.c_str());
+			out += ", \"stats\": " + run.jobs[i].stats + "}";
+		}
+		printf("%s\n]\n", out.c_str());
+	}
+	return failed;
 }
 
+// Blocksizes of the default pass schedule that are worth a signature; the
+// smaller ones only ever hash small holes.
+const unsigned signatureBlocksizes[] = {997, 503, 127, 31, 13};
+
 int main(int argc, char **argv) {
 	try {
-		bool all_ram_mode = false;
-		char * m1 = NULL;
-		char * m2 = NULL;
+#ifdef BDELTA_HAVE_MMAP
+		InputMode mode = INPUT_MMAP;
+#else
+		InputMode mode = INPUT_FILE;
+#endif
+		const char * m1 = NULL;
+		const char * m2 = NULL;
+		unsigned numThreads = 1;
+		unsigned hashFlags = BDELTA_HASH_POLYNOMIAL;
+		uint64_t memoryLimit = 0;
+		const char *passSpec = "997:1994,503:1006,127:254,31:62,7:14,5:10,3:6,13:26g,7:14,5:10";
+		BDelta_PlanLimits limits = {0, 0, 0};
+		// The prepass only runs when asked for: the passes never hash what it
+		// matched again, so old data it claims can't be copied a second time.
+		int prepassBlocksize = -1; // -1 for none
+		unsigned patchVersion = 0; // 1, or 2 with --ref
+		int codec = CODEC_NONE, codecLevel = 0;
+		uint64_t chunkSize = 0;
+		bool makeSignature = false;
+		const char *manifest = NULL;
+		bool wantStats = false;
+		const char *signatureFile = NULL;
+		std::vector<const char *> refs; // After the old file, with --ref
 
-		if (argc > 1 && strcmp(argv[1], "--all-in-ram") == 0)
+		while (argc > 1 && argv[1][0] == '-')
 		{
-			all_ram_mode = true;
+			if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+				numThreads = atoi(argv[2]);
+				if (numThreads == 0) numThreads = 1;
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--hash") == 0 && argc > 2) {
+				if (strcmp(argv[2], "polynomial") == 0)
+					hashFlags = BDELTA_HASH_POLYNOMIAL;
+				else if (strcmp(argv[2], "buzhash") == 0)
+					hashFlags = BDELTA_HASH_BUZHASH;
+				else if (strcmp(argv[2], "crc32c") == 0)
+					hashFlags = BDELTA_HASH_CRC32C;
+				else {
+					printf("unknown hash: %s\n", argv[2]);
+					exit(1);
+				}
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--memory-limit") == 0 && argc > 2) {
+				// In megabytes
+				memoryLimit = (uint64_t)strtoull(argv[2], NULL, 10) << 20;
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--passes") == 0 && argc > 2) {
+				passSpec = argv[2];
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--prepass") == 0 && argc > 2) {
+				// 0 for just the common prefix and suffix
+				prepassBlocksize = atoi(argv[2]);
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--no-prepass") == 0)
+				prepassBlocksize = -1;
+			else if (strcmp(argv[1], "--min-hole") == 0 && argc > 2) {
+				limits.minHoleTokens = strtoull(argv[2], NULL, 10);
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--min-gain") == 0 && argc > 2) {
+				limits.minGain = strtoull(argv[2], NULL, 10);
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--time-budget") == 0 && argc > 2) {
+				// In seconds
+				limits.timeBudget = atof(argv[2]);
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--patch-version") == 0 && argc > 2) {
+				patchVersion = atoi(argv[2]);
+				if (patchVersion != 1 && patchVersion != 2) {
+					printf("unknown patch version: %s\n", argv[2]);
+					exit(1);
+				}
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--chunk-size") == 0 && argc > 2) {
+				// In megabytes
+				chunkSize = (uint64_t)strtoull(argv[2], NULL, 10) << 20;
+				if (!chunkSize) {
+					printf("bad chunk size: %s\n", argv[2]);
+					exit(1);
+				}
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--compress") == 0 && argc > 2) {
+				// codec[:level]
+				char name[16];
+				strncpy(name, argv[2], sizeof(name) - 1);
+				name[sizeof(name) - 1] = 0;
+				char *colon = strchr(name, ':');
+				if (colon) {
+					*colon = 0;
+					codecLevel = atoi(colon + 1);
+				}
+				codec = codec_by_name(name);
+				if (codec < 0) {
+					printf("unknown compression: %s\n", argv[2]);
+					exit(1);
+				}
+				if (!codec_supported(codec)) {
+					printf("bdelta was built without %s support\n", name);
+					exit(1);
+				}
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--signature") == 0 && argc > 2) {
+				signatureFile = argv[2];
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--ref") == 0 && argc > 2) {
+				refs.push_back(argv[2]);
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--batch") == 0 && argc > 2) {
+				manifest = argv[2];
+				--argc;
+				++argv;
+			}
+			else if (strcmp(argv[1], "--stats") == 0)
+				wantStats = true;
+			else if (strcmp(argv[1], "--make-signature") == 0)
+				makeSignature = true;
+			else if (strcmp(argv[1], "--all-in-ram") == 0)
+				mode = INPUT_RAM;
+			else if (strcmp(argv[1], "--mmap") == 0)
+				mode = INPUT_MMAP;
+			else if (strcmp(argv[1], "--no-mmap") == 0)
+				mode = INPUT_FILE;
+			else
+				break;
 			--argc;
 			++argv;
 		}
-		if (argc != 4) {
-			printf("usage: bdelta [--all-in-ram] <oldfile> <newfile> <patchfile>\n");
-			printf("needs two files to compare + output file:\n");
+		if (argc != (manifest ? 1 : makeSignature ? 3 : 4) || (manifest && (makeSignature || signatureFile)) ||
+				(!refs.empty() && (manifest || makeSignature || signatureFile))) {
+			printf("usage: bdelta [-j threads] [--hash polynomial|buzhash|crc32c] [--all-in-ram | --mmap | --no-mmap]\n");
+			printf("              [--prepass <blocksize> | --no-prepass] [--passes <schedule>] [--min-hole <bytes>] [--min-gain <bytes>] [--time-budget <seconds>]\n");
+			printf("              [--memory-limit <MB>] [--signature <sigfile>] [--patch-version 1|2]\n");
+			printf("              [--compress zstd|lz4[:level] | --chunk-size <MB>] [--stats] [--ref <reffile>]...\n");
+			printf("              <oldfile> <newfile | -> <patchfile>\n");
+			printf("       bdelta [options as above, but --signature] --batch <manifest>\n");
+			printf("       bdelta [-j threads] [--hash polynomial|buzhash|crc32c] --make-signature <oldfile> <sigfile>\n");
+			printf("--prepass matches common ends and data left in place before the passes, which is fast\n");
+			printf("for appends and edits in place, but the old data it matches can't be copied again;\n");
+			printf("needs two files to compare + output file, a manifest of such, one tab-separated\n");
+			printf("<oldfile> <newfile> <patchfile> per line, or a file to make a signature of + output file;\n");
+			printf("each --ref is another reference, after oldfile, for the new file to copy from:\n");
+			exit(1);
+		}
+		std::vector<BDelta_Pass> passes;
+		if (!parse_passes(passSpec, hashFlags, passes)) {
+			printf("bad pass schedule: %s\n", passSpec);
+			exit(1);
+		}
+		// --compress and --chunk-size each pick a patch version of their own.
+		if (patchVersion && (codec != CODEC_NONE || chunkSize)) {
+			printf("--patch-version can't be used with --compress or --chunk-size\n");
+			exit(1);
+		}
+		if (codec != CODEC_NONE && chunkSize) {
+			printf("--compress can't be used with --chunk-size\n");
+			exit(1);
+		}
+		if (!refs.empty() && patchVersion == 1) {
+			printf("--ref needs patch version 2 or later\n");
 			exit(1);
 		}
-		if (!fileExists(argv[1]) || !fileExists(argv[2])) {
+		if (!patchVersion) patchVersion = refs.empty() ? 1 : 2;
+		PatchOptions patchOptions = {patchVersion, codec, codecLevel, chunkSize, std::vector<uint64_t>()};
+		if (manifest) {
+			BatchRun run;
+			if (!read_manifest(manifest, run.jobs)) exit(1);
+			run.mode = mode;
+			run.prepassBlocksize = prepassBlocksize;
+			run.prepassMinMatch = passes[0].minMatchSize;
+			run.patchOptions = patchOptions;
+			run.wantStats = wantStats;
+			return run_batch(run, passes, limits, memoryLimit, numThreads) ? -1 : 0;
+		}
+		// A signature is only of the old file; it stands in for the new one too.
+		const char *newfile = makeSignature ? argv[1] : argv[2];
+		// A new file of "-" is read from stdin; the old one must be seekable.
+		bool newPiped = !makeSignature && strcmp(newfile, "-") == 0;
+		refs.insert(refs.begin(), argv[1]);
+		bool missing = !newPiped && !fileExists(newfile);
+		for (size_t i = 0; i < refs.size(); ++i)
+			missing |= !fileExists(refs[i]);
+		if (missing) {
 			printf("one of the input files does not exist\n");
 			exit(1);
 		}
-		unsigned size = getLenOfFile(argv[1]);
-		unsigned size2 = getLenOfFile(argv[2]);
-		FILE *f1 = fopen(argv[1], "rb"),
-		     *f2 = fopen(argv[2], "rb");
+		uint64_t size, size2;
+		FILE *f1 = NULL, *f2;
+		// Several references are diffed against as one, their concatenation,
+		// instead of f1.
+		Concatenation refSet;
+		if (refs.size() > 1) {
+			for (size_t i = 0; i < refs.size(); ++i) {
+				FILE *f = fopen(refs[i], "rb");
+				uint64_t len = getLenOfFile(refs[i]);
+				refSet.add(f, len, mode == INPUT_MMAP ? (const char *)map_file(f, len) : NULL);
+			}
+			patchOptions.refSizes = refSet.sizes;
+			size = refSet.size();
+		} else {
+			size = getLenOfFile(argv[1]);
+			f1 = fopen(argv[1], "rb");
+		}
+		if (newPiped) {
+			set_binary_mode(stdin);
+			f2 = spool_stream(stdin, size2);
+		} else {
+			size2 = getLenOfFile(newfile);
+			f2 = fopen(newfile, "rb");
+		}
 		
 		BDelta_Instance *b;
 
-		if (all_ram_mode)
+		if (mode == INPUT_MMAP)
+		{
+			m1 = f1 ? (const char *)map_file(f1, size) : NULL;
+			m2 = (const char *)map_file(f2, size2);
+			if ((f1 && !m1) || !m2) {
+				// Not mappable (e.g. a special file); read through stdio instead.
+				unmap_file(m1, size);
+				unmap_file(m2, size2);
+				m1 = m2 = NULL;
+				mode = INPUT_FILE;
+			}
+		}
+		if (mode == INPUT_RAM)
 		{
-			m1 = new char[size];
-			m2 = new char[size2];
-			fread_fixed(f1, m1, size);
-			fread_fixed(f2, m2, size2);
+			char * r1 = new char[(size_t)size];
+			char * r2 = new char[(size_t)size2];
+			if (f1)
+				fread_fixed(f1, r1, size);
+			else
+				for (size_t i = 0; i < refs.size(); ++i)
+					fread_fixed(refSet.files[i], r1 + refSet.ends[i] - refSet.sizes[i], refSet.sizes[i]);
+			fread_fixed(f2, r2, size2);
+			m1 = r1;
+			m2 = r2;
+		}
 
-			b = bdelta_init_alg(size, size2, m_read, m1, m2, 1);
+		// How the patch reads the new file's unmatched data
+		patch_readCallback read2 = mode == INPUT_FILE ? f_read : m_read;
+		void *handle2 = mode == INPUT_FILE ? (void *)f2 : (void *)m2;
+		Concatenation newSet; // The new file, to be read by c_read() too
+		if (!f1 && mode != INPUT_RAM) {
+			newSet.add(f2, size2, m2);
+			if (!refSet.mapped() || !newSet.mapped()) numThreads = 1;
+			b = bdelta_init_alg64(size, size2, c_read, &refSet, &newSet, 1);
+			bdelta_set_prefetch(b, c_prefetch, 0);
+			read2 = c_read;
+			handle2 = &newSet;
+		}
+		else if (mode == INPUT_FILE) {
+			// f_read shares one FILE per input, so it can't serve several threads.
+			numThreads = 1;
+			b = bdelta_init_alg64(size, size2, f_read, f1, f2, 1);
+			bdelta_set_prefetch(b, f_prefetch, 0);
 		}
 		else
-		{
-			b = bdelta_init_alg(size, size2, f_read, f1, f2, 1);
+			b = bdelta_init_mem(m1, size, m2, size2, 1);
+		bdelta_set_memory_limit(b, memoryLimit);
+		if (refs.size() > 1)
+			bdelta_set_references(b, &patchOptions.refSizes[0], refs.size());
+
+		BDelta_Signature *sig = NULL;
+		if (makeSignature) {
+			sig = bdelta_signature_build(b, signatureBlocksizes,
+				sizeof(signatureBlocksizes) / sizeof(signatureBlocksizes[0]), hashFlags, numThreads);
+			if (bdelta_signature_save(sig, argv[2]) != BDELTA_OK) {
+				printf("couldn't write signature file\n");
+				exit(1);
+			}
+		} else if (signatureFile) {
+			sig = bdelta_signature_load(signatureFile);
+			if (!sig) {
+				printf("couldn't load signature file\n");
+				exit(1);
+			}
+			if (bdelta_use_signature(b, sig) != BDELTA_OK) {
+				printf("signature is not of the given old file\n");
+				exit(1);
+			}
 		}
-		int nummatches;
 
 		// List of primes for reference. Taken from Wikipedia.
 		//            1	  2	  3	  4	  5	  6	  7	  8	  9	 10	 11	 12	 13	 14	 15	 16	 17	 18	 19	 20
@@ -90,100 +752,34 @@ int main(int argc, char **argv) {
 		// 141-160  811	821	823	827	829	839	853	857	859	863	877	881	883	887	907	911	919	929	937	941
 		// 161-180  947	953	967	971	977	983	991	997
 
-		my_pass(b, 997, 1994, 0);
-		my_pass(b, 503, 1006, 0);
-		my_pass(b, 127, 254, 0);
-		my_pass(b,  31,  62, 0);
-		my_pass(b,   7,  14, 0);
-		my_pass(b,   5,  10, 0);
-		my_pass(b,   3,   6, 0);
-		my_pass(b,  13,  26, BDELTA_GLOBAL);
-		my_pass(b,   7,  14, 0);
-		my_pass(b,   5,  10, 0);
-
-		nummatches = bdelta_numMatches(b);
-
-		unsigned * copyloc1 = new unsigned[nummatches + 1];
-		unsigned * copyloc2 = new unsigned[nummatches + 1];
-		unsigned *  copynum = new unsigned[nummatches + 1];
-
-		FILE *fout = fopen(argv[3], "wb");
-		if (!fout) {
-			printf("couldn't open output file\n");
-			exit(1);
-		}
+		if (!makeSignature) {
+			if (prepassBlocksize >= 0)
+				bdelta_prepass(b, prepassBlocksize, passes[0].minMatchSize);
+			bdelta_run_passes(b, &passes[0], passes.size(), &limits, numThreads);
 
-		const char *magic = "BDT";
-		fwrite_fixed(fout, magic, 3);
-		unsigned short version = 1;
-		write_word(fout, version);
-		unsigned char intsize = 4;
-		fwrite_fixed(fout, &intsize, 1);
-		write_dword(fout, size);
-		write_dword(fout, size2);
-		write_dword(fout, nummatches);
-
-		unsigned lastp1 = 0,
-			lastp2 = 0;
-		for (int i = 0; i < nummatches; ++i) {
-			unsigned p1, p2, num;
-			bdelta_getMatch(b, i, &p1, &p2, &num);
-			// printf("%*x, %*x, %*x, %*x\n", 10, p1, 10, p2, 10, num, 10, p2-lastp2);
-			copyloc1[i] = p1 - lastp1;
-			write_dword(fout, copyloc1[i]);
-			copyloc2[i] = p2 - lastp2;
-			write_dword(fout, copyloc2[i]);
-			copynum[i] = num;
-			write_dword(fout, copynum[i]);
-			lastp1 = p1 + num;
-			lastp2 = p2 + num;
-		}
-		if (size2 != lastp2) {
-			copyloc1[nummatches] = 0; copynum[nummatches] = 0;
-			copyloc2[nummatches] = size2 - lastp2;
-			++nummatches;
-		}
-
-// write_unsigned_list(adds, nummatches+1, fout);
-// write_unsigned_list(copynum, nummatches, fout);
-// write_signed_list(copyloc, nummatches, fout);
-
-//  fwrite(copyloc1, 4, nummatches, fout);
-//  fwrite(copyloc2, 4, nummatches, fout);
-//  fwrite(copynum, 4, nummatches, fout);
-		unsigned fp = 0;
-		for (int i = 0; i < nummatches; ++i) {
-			unsigned num = copyloc2[i];
-			while (num > 0) {
-				unsigned towrite = (num > 4096) ? 4096 : num;
-				unsigned char buf[4096];
-				const void * b;
-				if (all_ram_mode)
-					b = m_read(m2, buf, fp, towrite);
-				else
-					b = f_read(f2, buf, fp, towrite);
-				fwrite_fixed(fout, b, towrite);
-				num -= towrite;
-				fp += towrite;
-			}
-			// fp+=copyloc2[i];
-			if (i != nummatches) fp += copynum[i];
-		}
- 
-		fclose(fout);
+			if (!write_patch(b, argv[3], size, size2, read2, handle2, patchOptions)) {
+				printf("couldn't open output file\n");
+				exit(1);
+			}
+			// Written to stdout as JSON, once the patch is done.
+			if (wantStats) printf("%s\n", stats_json(b).c_str());
+		}
 
 		bdelta_done_alg(b);
+		bdelta_signature_free(sig);
 
-		delete [] m1;
-		delete [] m2;
+		if (mode == INPUT_MMAP) {
+			unmap_file(m1, size);
+			unmap_file(m2, size2);
+		} else {
+			delete [] m1;
+			delete [] m2;
+		}
 
-		fclose(f1);
+		if (f1) fclose(f1);
+		refSet.close();
 		fclose(f2);
 
-		delete [] copynum;
-		delete [] copyloc2;
-		delete [] copyloc1;
-
 	} catch (const char * desc){
 		fprintf (stderr, "FATAL: %s\n", desc);
 		return -1;
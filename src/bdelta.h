@@ -2,23 +2,193 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+// Visual C++ only has stdint.h from 2010 on.
+#if defined(_MSC_VER) && _MSC_VER < 1600
+	typedef unsigned __int64 uint64_t;
+#else
+	#include <stdint.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif // __cplusplus
 
 typedef struct _BDelta_Instance BDelta_Instance;
+typedef struct _BDelta_Signature BDelta_Signature;
 
 // Callback function must return a pointer to the data requested.
 // A "fill and forget" buffer is provided, but can be ignored, so
 // long as the data persists throughout the life of bdelta_pass().
 typedef const void *(*bdelta_readCallback)(void *handle, void *buf, unsigned place, unsigned num);
+typedef const void *(*bdelta_readCallback64)(void *handle, void *buf, uint64_t place, unsigned num);
 
+// tokenSize is the size in bytes (1, 2 or 4) of the units the inputs are
+// compared in.  Sizes, positions and match lengths all count tokens.
 BDelta_Instance *bdelta_init_alg(unsigned data1_size, unsigned data2_size,
 		bdelta_readCallback cb, void *handle1, void *handle2,
 		unsigned tokenSize);
+// As bdelta_init_alg(), for inputs of 4GB or more.  Use bdelta_getMatch64()
+// to read back matches beyond the 32-bit range.
+BDelta_Instance *bdelta_init_alg64(uint64_t data1_size, uint64_t data2_size,
+		bdelta_readCallback64 cb, void *handle1, void *handle2,
+		unsigned tokenSize);
+// For inputs that are wholly resident in memory.  The buffers are read in
+// place and must stay valid and unchanged for the life of the instance.
+// Matches are then extended by comparing the buffers directly, rather than
+// through a callback in 4096-token pieces.
+BDelta_Instance *bdelta_init_mem(const void *data1, uint64_t data1_size,
+		const void *data2, uint64_t data2_size,
+		unsigned tokenSize);
 void bdelta_done_alg(BDelta_Instance *b);
+// Readies an instance for another pair of inputs, of the kind it was made
+// for: handle1 and handle2 are passed to the callback as before, or, for an
+// instance from bdelta_init_mem(), are the new buffers.  Matches are cleared
+// and any signature is detached, but the memory the passes work in is kept,
+// so diffing many pairs with one instance avoids reallocating it.
+void bdelta_reset(BDelta_Instance *b, uint64_t data1_size, uint64_t data2_size,
+		void *handle1, void *handle2);
 
 void bdelta_pass(BDelta_Instance *b, unsigned blockSize, unsigned minMatchSize, unsigned maxHoleSize, unsigned flags);
+// As bdelta_pass(), spreading the work over up to numThreads threads.  The
+// resulting matches are the same as bdelta_pass() gives for any numThreads.
+// With more than one thread the read callback is called concurrently, so it
+// must be thread-safe.
+void bdelta_pass_mt(BDelta_Instance *b, unsigned blockSize, unsigned minMatchSize, unsigned maxHoleSize, unsigned flags, unsigned numThreads);
+
+// A linear scan to run before the first pass, for inputs that differ by
+// an append or edits in place.  Matches the common prefix and suffix, and
+// if blockSize is nonzero, checks every blockSize tokens in between for
+// data at the same position in both inputs, matching each such run in
+// full.  Matches shorter than minMatchSize are dropped.  The passes then
+// only hash what is left.
+void bdelta_prepass(BDelta_Instance *b, unsigned blockSize, unsigned minMatchSize);
+
+// A schedule of passes, as given to bdelta_pass(), for bdelta_run_passes().
+typedef struct {
+	unsigned blockSize, minMatchSize, maxHoleSize, flags;
+} BDelta_Pass;
+
+// When bdelta_run_passes() may cut its schedule short.  Zero fields don't
+// limit anything.
+typedef struct {
+	uint64_t minHoleTokens; // Stop once no more of the second input than this is unmatched
+	uint64_t minGain;       // Skip non-global passes after one that matched fewer new tokens
+	double timeBudget;      // Seconds; no pass is started after this long
+} BDelta_PlanLimits;
+
+// Runs passes in order, removing overlap between matches after each one.
+// limits may be NULL to run them all.  Note that a time budget makes the
+// result depend on the machine's speed.
+void bdelta_run_passes(BDelta_Instance *b, const BDelta_Pass *passes, unsigned numPasses,
+		const BDelta_PlanLimits *limits, unsigned numThreads);
+
+// Many pairs of inputs to diff with bdelta_run_batch().  The callbacks are
+// made from its worker threads, several at once, so they must be
+// thread-safe.
+typedef struct {
+	unsigned numJobs;
+	const uint64_t *jobSizes; // If not NULL, jobs are started largest first
+	// Readies an instance for job jobNum with bdelta_reset(), and may run
+	// bdelta_prepass() on it.  Returns nonzero to skip the job.
+	int (*open)(void *context, unsigned jobNum, BDelta_Instance *b);
+	// Takes the job's matches from b once its passes are done.
+	void (*done)(void *context, unsigned jobNum, BDelta_Instance *b);
+	void *context;
+} BDelta_Batch;
+
+// Runs the passes of bdelta_run_passes() on every job of a batch.  Jobs are
+// spread over one thread per instance, each taking the next job as it
+// finishes one, and running its passes single-threaded.  A thread keeps its
+// instance for all its jobs, so the memory the passes work in is reused.
+// The instances must all be made the same way, reading inputs as every
+// job's open() expects.
+void bdelta_run_batch(BDelta_Instance **instances, unsigned numInstances, const BDelta_Batch *batch,
+		const BDelta_Pass *passes, unsigned numPasses, const BDelta_PlanLimits *limits);
+
+// A signature holds the checksums of an instance's first input for a set of
+// blocksizes, computed once with the hash chosen by the BDELTA_HASH_* bits
+// of flags.  Once attached to instances with the same first input, their
+// passes with a matching blocksize and hash use it instead of hashing that
+// input again.  Those passes consider the signature's blocks, which are
+// aligned to the blocksize, rather than blocks aligned to each unused
+// range, so results can differ slightly from passes without it.
+// A saved signature is loaded memory-mapped, read-only; it may be shared
+// by any number of instances and threads, and must outlive them.
+BDelta_Signature *bdelta_signature_build(BDelta_Instance *b, const unsigned *blockSizes, unsigned numBlockSizes,
+	unsigned flags, unsigned numThreads);
+int bdelta_signature_save(const BDelta_Signature *sig, const char *path);
+BDelta_Signature *bdelta_signature_load(const char *path); // NULL on failure
+void bdelta_signature_free(BDelta_Signature *sig);
+// Returns BDELTA_SIGNATURE_MISMATCH if sig is of a different first input
+// size or token size.  NULL detaches.  Swapping the inputs detaches it too.
+int bdelta_use_signature(BDelta_Instance *b, const BDelta_Signature *sig);
+
+// Makes the first input the concatenation of numRefs references, of the
+// sizes given in tokens, which must add up to its size; else returns
+// BDELTA_REFERENCE_MISMATCH.  All are indexed and searched together, but
+// matches are split where they would run from one reference into the
+// next, so each copies from just one.  The read callback and buffers still
+// address the first input as a whole.  numRefs of 0 or 1 goes back to a
+// single one.  Swapping the inputs, or bdelta_reset(), does so too.
+int bdelta_set_references(BDelta_Instance *b, const uint64_t *refSizes, unsigned numRefs);
+
+// Caps the memory each pass's checksum table may take, in bytes; 0, the
+// default, is no limit.  A pass whose table would be bigger indexes only a
+// sample of the first input's blocks, chosen by content so that repeated
+// data is still found, and finds fewer of the shorter matches.  With more
+// than one thread, non-global passes may build one table per thread at once.
+void bdelta_set_memory_limit(BDelta_Instance *b, uint64_t bytes);
+
+// A hint that the library will soon read num tokens at place, so that a
+// slow or remote input can fetch them in the background.  It must not
+// block; reads still go through the read callback, which must return the
+// data whether or not it was prefetched.  Called from the worker threads
+// of a pass, several at once if it has more than one.
+typedef void (*bdelta_prefetchCallback)(void *handle, uint64_t place, unsigned num);
+
+// Has the passes call prefetch, for handle1 or handle2, about ahead tokens
+// before they read sequentially: as they hash the first input's blocks and
+// scan the second input.  ahead is 0 for a default of 1M tokens.  The hints
+// cover most of the data read; the short reads that extend each candidate
+// match aren't hinted.  NULL turns it off.  Not used by instances from
+// bdelta_init_mem().
+void bdelta_set_prefetch(BDelta_Instance *b, bdelta_prefetchCallback prefetch, unsigned ahead);
+
+typedef struct {
+	uint64_t peakIndexBytes;  // Biggest checksum table of any pass, with its working space
+	uint64_t blocksIndexed;   // Blocks added to the checksum tables, over all passes
+	uint64_t blocksSkipped;   // Blocks left out to keep within the memory limit
+	unsigned sampledPasses;   // Passes that had to sample
+	unsigned numPasses;       // Passes run
+	uint64_t matchedTokens;   // Tokens of the second input covered by matches after the last pass
+} BDelta_Stats;
+
+// Totals since the instance was made or last reset.
+void bdelta_get_stats(BDelta_Instance *b, BDelta_Stats *stats);
+
+// What one pass did, for profiling.  Times are in seconds.  The build and
+// scan times add up those of every hole searched, so with several threads
+// they can exceed the pass's own time.  Positions and sizes count tokens.
+typedef struct {
+	unsigned blockSize, flags;
+	uint64_t checksums;      // Blocks of the first input hashed
+	uint64_t dropped;        // Locations left out of the tables, as too common or past capacity
+	uint64_t probes;         // Table lookups, one per position of the second input rolled over
+	uint64_t hits;           // Locations the lookups found
+	uint64_t falseHits;      // Hits whose data matched for less than a block
+	uint64_t comparedTokens; // Tokens matched extending hits forwards and backwards
+	uint64_t reads;          // Calls to the read callback; 0 for bdelta_init_mem() instances
+	uint64_t readBytes;      // Bytes those calls asked for
+	uint64_t matchesAdded;   // Matches the pass found
+	double buildSeconds;     // Hashing the first input and filling the tables
+	double scanSeconds;      // Rolling over the second input and extending hits
+	double sortSeconds;      // Ordering the holes and merging in the new matches
+	double seconds;          // The whole pass
+} BDelta_PassStats;
+
+// Stats for pass passNum, counting from 0, of the numPasses that
+// bdelta_get_stats() reports.
+void bdelta_get_pass_stats(BDelta_Instance *b, unsigned passNum, BDelta_PassStats *stats);
 
 void bdelta_swap_inputs(BDelta_Instance *b);
 void bdelta_clean_matches(BDelta_Instance *b, unsigned flags);
@@ -27,6 +197,20 @@ unsigned bdelta_numMatches(BDelta_Instance *b);
 
 void bdelta_getMatch(BDelta_Instance *b, unsigned matchNum,
 	unsigned *p1, unsigned *p2, unsigned *num);
+void bdelta_getMatch64(BDelta_Instance *b, unsigned matchNum,
+	uint64_t *p1, uint64_t *p2, uint64_t *num);
+
+// The reference, counting from 0, that match matchNum copies from, and
+// where in that reference it starts if offset isn't NULL.
+unsigned bdelta_getMatchRef(BDelta_Instance *b, unsigned matchNum, uint64_t *offset);
+
+// Copies matches start to start + count - 1 into the caller's arrays in one
+// call.  Any of the arrays may be NULL.  Returns the number of matches copied,
+// which is less than count if the range runs past the last match.
+unsigned bdelta_getMatches(BDelta_Instance *b, unsigned start, unsigned count,
+	unsigned *p1, unsigned *p2, unsigned *num);
+unsigned bdelta_getMatches64(BDelta_Instance *b, unsigned start, unsigned count,
+	uint64_t *p1, uint64_t *p2, uint64_t *num);
 
 int bdelta_getError(BDelta_Instance *b);
 void bdelta_showMatches(BDelta_Instance *b);
@@ -34,14 +218,23 @@ void bdelta_showMatches(BDelta_Instance *b);
 // Flags for bdelta_pass()
 #define BDELTA_GLOBAL 1
 #define BDELTA_SIDES_ORDERED 2
+// Rolling hash used to find matching blocks.  The default is a polynomial
+// hash; the others can be quicker, or give fewer false hits, on some data.
+#define BDELTA_HASH_POLYNOMIAL 0
+#define BDELTA_HASH_BUZHASH    4
+#define BDELTA_HASH_CRC32C     8
+#define BDELTA_HASH_MASK       12
 
 // Flags for bdelta_clean_matches()
 #define BDELTA_REMOVE_OVERLAP 1
 
 enum BDELTA_RESULT {
-	BDELTA_OK         =  0,
-	BDELTA_MEM_ERROR  = -1,
-	BDELTA_READ_ERROR = -2
+	BDELTA_OK                 =  0,
+	BDELTA_MEM_ERROR          = -1,
+	BDELTA_READ_ERROR         = -2,
+	BDELTA_WRITE_ERROR        = -3,
+	BDELTA_SIGNATURE_MISMATCH = -4,
+	BDELTA_REFERENCE_MISMATCH = -5
 };
 
 #ifdef __cplusplus
@@ -2,18 +2,30 @@
 # License, v. 2.0. If a copy of the MPL was not distributed with this
 # file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
+from cpython cimport array
+from cpython.buffer cimport PyObject_GetBuffer, PyBuffer_Release, PyBUF_C_CONTIGUOUS, PyBUF_FORMAT
+from libc.stdint cimport uint64_t
+from libc.stdlib cimport malloc, free
+import array
+
 cdef extern from "bdelta.h":
     ctypedef struct BDelta_Instance:
         pass
 
-    ctypedef void *const_void_ptr "const void*"
-    ctypedef void *(*bdelta_readCallback)(void *handle, void *buf, unsigned place, unsigned num)
-    BDelta_Instance *bdelta_init_alg(unsigned data1_size, unsigned data2_size,
-        bdelta_readCallback cb, void *handle1, void *handle2,
+    BDelta_Instance *bdelta_init_mem(const void *data1, uint64_t data1_size,
+        const void *data2, uint64_t data2_size,
         unsigned tokenSize)
     void bdelta_done_alg(BDelta_Instance *b)
     
-    void bdelta_pass(BDelta_Instance *b, unsigned blockSize, unsigned minMatchSize, unsigned maxHoleSize, unsigned flags)
+    void bdelta_pass_mt(BDelta_Instance *b, unsigned blockSize, unsigned minMatchSize, unsigned maxHoleSize, unsigned flags,
+        unsigned numThreads) nogil
+
+    ctypedef struct BDelta_Pass:
+        unsigned blockSize, minMatchSize, maxHoleSize, flags
+    ctypedef struct BDelta_PlanLimits:
+        pass
+    void bdelta_run_passes(BDelta_Instance *b, const BDelta_Pass *passes, unsigned numPasses,
+        const BDelta_PlanLimits *limits, unsigned numThreads) nogil
 
     void bdelta_swap_inputs(BDelta_Instance *b)
     void bdelta_clean_matches(BDelta_Instance *b, unsigned flags)
@@ -22,6 +34,22 @@ cdef extern from "bdelta.h":
 
     void bdelta_getMatch(BDelta_Instance *b, unsigned matchNum,
 	    unsigned *p1, unsigned *p2, unsigned *num)
+    unsigned bdelta_getMatches(BDelta_Instance *b, unsigned start, unsigned count,
+        unsigned *p1, unsigned *p2, unsigned *num)
+    unsigned bdelta_getMatches64(BDelta_Instance *b, unsigned start, unsigned count,
+        uint64_t *p1, uint64_t *p2, uint64_t *num)
+
+    ctypedef struct BDelta_Stats:
+        uint64_t peakIndexBytes, blocksIndexed, blocksSkipped
+        unsigned sampledPasses, numPasses
+        uint64_t matchedTokens
+    ctypedef struct BDelta_PassStats:
+        unsigned blockSize, flags
+        uint64_t checksums, dropped, probes, hits, falseHits, comparedTokens
+        uint64_t reads, readBytes, matchesAdded
+        double buildSeconds, scanSeconds, sortSeconds, seconds
+    void bdelta_get_stats(BDelta_Instance *b, BDelta_Stats *stats)
+    void bdelta_get_pass_stats(BDelta_Instance *b, unsigned passNum, BDelta_PassStats *stats)
 
     int bdelta_getError(BDelta_Instance *b)
     void bdelta_showMatches(BDelta_Instance *b)
@@ -32,30 +60,125 @@ cdef extern from "bdelta.h":
     cdef enum CleanFlags:
         BDELTA_REMOVE_OVERLAP
 
-cdef const_void_ptr readCallback(void *handle, void *buf, unsigned place, unsigned num):
-    cdef char *str = <bytes>handle
-    return str + ((place + 1) * 2);
+GLOBAL = BDELTA_GLOBAL
+SIDES_ORDERED = BDELTA_SIDES_ORDERED
+
+cdef array.array _unsigned_template = array.array('I')
+cdef array.array _uint64_template = array.array('Q')
+
+# Holds a view of obj in view, which is released with PyBuffer_Release().
+# Text is compared as UTF-16; anything else must support the buffer
+# protocol, and is compared in place, in tokens of its item size.
+cdef Py_ssize_t get_input(obj, Py_buffer *view) except -1:
+    if isinstance(obj, unicode):
+        PyObject_GetBuffer(obj.encode('UTF-16-LE'), view, PyBUF_C_CONTIGUOUS)
+        return 2
+    PyObject_GetBuffer(obj, view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT)
+    return view.itemsize
 
 cdef class BDelta:
+    """Diffs two inputs: str, or any C-contiguous object supporting the buffer
+    protocol (bytes, bytearray, mmap, array, numpy arrays, ...).  Buffers
+    are read in place, not copied, and must not change while the object is
+    alive.  The token size defaults to the inputs' item size; str is
+    compared in 2-byte UTF-16 units.  The passes run without the GIL, but
+    an object mustn't be used from several threads at once."""
     cdef BDelta_Instance *_b
-    cdef bytes str1, str2
+    cdef Py_buffer view1, view2
+    cdef bint held1, held2
+    cdef bint wide # Whether positions can exceed 32 bits
 
-    def __cinit__(self, str1, str2):
-        self.str1 = str1.encode('UTF-16')
-        self.str2 = str2.encode('UTF-16')
-        self._b = bdelta_init_alg(len(str1), len(str2), readCallback, <void*>self.str1, <void*>self.str2, 2)
+    def __cinit__(self, a, b, tokenSize = None):
+        cdef Py_ssize_t size1 = get_input(a, &self.view1)
+        self.held1 = True
+        cdef Py_ssize_t size2 = get_input(b, &self.view2)
+        self.held2 = True
+        if tokenSize is None:
+            if size1 != size2:
+                raise ValueError("inputs have different item sizes, %d and %d" % (size1, size2))
+            tokenSize = size1
+        if tokenSize not in (1, 2, 4):
+            raise ValueError("token size must be 1, 2 or 4, not %d" % tokenSize)
+        if self.view1.len % tokenSize or self.view2.len % tokenSize:
+            raise ValueError("input length isn't a multiple of the token size")
+        cdef uint64_t len1 = self.view1.len // tokenSize, len2 = self.view2.len // tokenSize
+        self.wide = len1 > 0xffffffff or len2 > 0xffffffff
+        self._b = bdelta_init_mem(self.view1.buf, len1, self.view2.buf, len2, tokenSize)
+        if self._b == NULL:
+            raise MemoryError()
 
     def __dealloc__(self):
-        self.str1 = None
-        self.str2 = None
-        bdelta_done_alg(self._b)
+        if self._b != NULL:
+            bdelta_done_alg(self._b)
+        if self.held1:
+            PyBuffer_Release(&self.view1)
+        if self.held2:
+            PyBuffer_Release(&self.view2)
+
+    def b_pass(self, unsigned blockSize, unsigned minMatchSize, unsigned maxHoleSize, globalScope = False, sidesOrdered = False,
+            unsigned numThreads = 1):
+        cdef unsigned flags = (BDELTA_GLOBAL if globalScope else 0) | (BDELTA_SIDES_ORDERED if sidesOrdered else 0)
+        with nogil:
+            bdelta_pass_mt(self._b, blockSize, minMatchSize, maxHoleSize, flags, numThreads)
+
+    def run_passes(self, schedule, unsigned numThreads = 1):
+        """Runs a schedule of passes with bdelta_run_passes(), removing
+        overlap after each.  Each pass is a tuple (blockSize, minMatchSize),
+        optionally followed by maxHoleSize and flags, e.g. GLOBAL."""
+        schedule = [tuple(p) + (0,) * (4 - len(p)) for p in schedule]
+        cdef unsigned i, n = len(schedule)
+        cdef BDelta_Pass *passes = <BDelta_Pass *>malloc(max(n, 1) * sizeof(BDelta_Pass))
+        if passes == NULL:
+            raise MemoryError()
+        try:
+            for i in range(n):
+                passes[i].blockSize, passes[i].minMatchSize, passes[i].maxHoleSize, passes[i].flags = schedule[i]
+            with nogil:
+                bdelta_run_passes(self._b, passes, n, NULL, numThreads)
+        finally:
+            free(passes)
 
-    def b_pass(self, blockSize, minMatchSize, maxHoleSize, globalScope = False, sidesOrdered = False):
-        bdelta_pass(self._b, blockSize, minMatchSize, maxHoleSize,
-        	(BDELTA_GLOBAL if globalScope else 0) | (BDELTA_SIDES_ORDERED if sidesOrdered else 0))
+    def match_arrays(self):
+        """Returns the matches as three memoryviews (p1, p2, num) of unsigned
+        ints, or of 64-bit ones for inputs of 2^32 tokens or more, filled by
+        a single call into the library."""
+        cdef unsigned n = bdelta_numMatches(self._b)
+        cdef array.array q1, q2, qnum
+        if self.wide:
+            q1 = array.clone(_uint64_template, n, zero=False)
+            q2 = array.clone(_uint64_template, n, zero=False)
+            qnum = array.clone(_uint64_template, n, zero=False)
+            bdelta_getMatches64(self._b, 0, n, <uint64_t *>q1.data.as_ulonglongs, <uint64_t *>q2.data.as_ulonglongs,
+                <uint64_t *>qnum.data.as_ulonglongs)
+            return memoryview(q1), memoryview(q2), memoryview(qnum)
+        cdef array.array p1 = array.clone(_unsigned_template, n, zero=False)
+        cdef array.array p2 = array.clone(_unsigned_template, n, zero=False)
+        cdef array.array num = array.clone(_unsigned_template, n, zero=False)
+        bdelta_getMatches(self._b, 0, n, p1.data.as_uints, p2.data.as_uints, num.data.as_uints)
+        return memoryview(p1), memoryview(p2), memoryview(num)
 
     def matches(self):
-        cdef unsigned p1, p2, num
-        for i in xrange(bdelta_numMatches(self._b)):
-            bdelta_getMatch(self._b, i, &p1, &p2, &num)
-            yield (int(p1), int(p2), int(num))
\ No newline at end of file
+        p1, p2, num = self.match_arrays()
+        for i in xrange(len(p1)):
+            yield (int(p1[i]), int(p2[i]), int(num[i]))
+
+    def stats(self):
+        """Returns the totals of bdelta_get_stats() as a dict, with a list of
+        dicts of each pass's bdelta_get_pass_stats() under "passes"."""
+        cdef BDelta_Stats st
+        cdef BDelta_PassStats ps
+        bdelta_get_stats(self._b, &st)
+        result = st
+        passes = []
+        for i in range(st.numPasses):
+            bdelta_get_pass_stats(self._b, i, &ps)
+            passes.append(ps)
+        result['passes'] = passes
+        return result
+
+def diff(a, b, schedule, tokenSize = None, unsigned numThreads = 1):
+    """Diffs a and b, as BDelta() takes them, running the schedule of
+    BDelta.run_passes() in one call.  Returns the list of matches."""
+    d = BDelta(a, b, tokenSize)
+    d.run_passes(schedule, numThreads)
+    return list(d.matches())
@@ -3,17 +3,30 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <vector>
+#include <atomic>
+#include <thread>
+#include <mutex>
 #include "file.h"
+#include "codec.h"
 #include "compatibility.h"
 
-bool copy_bytes_to_file(FILE *infile, FILE *outfile, unsigned numleft) {
+#ifdef BDELTA_HAVE_MMAP
+	#include <errno.h>
+	#include <unistd.h>
+	#include <sys/stat.h>
+	#include <sys/uio.h>
+#endif
+
+bool copy_bytes_to_file(FILE *infile, FILE *outfile, uint64_t numleft) {
 	size_t numread;
 	do {
 		char buf[1024];
-		numread = fread(buf, 1, numleft > 1024 ? 1024 : numleft, infile);
+		numread = fread(buf, 1, numleft > 1024 ? 1024 : (size_t)numleft, infile);
 		if (fwrite(buf, 1, numread, outfile) != numread) {
-			printf("Could not write temporary data.  Possibly out of space\n");
+			fprintf(stderr, "Could not write temporary data.  Possibly out of space\n");
 			return false;
 		}
 		numleft -= numread;
@@ -21,79 +34,743 @@ bool copy_bytes_to_file(FILE *infile, FILE *outfile, unsigned numleft) {
 	return (numleft == 0);
 }
 
+// Copies unmatched data straight out of the patch reader's buffer.
+void copy_bytes_to_file(BufferedReader &in, FILE *outfile, uint64_t numleft) {
+	while (numleft) {
+		unsigned n;
+		const unsigned char *data = in.next(numleft, n);
+		fwrite_fixed(outfile, data, n);
+		numleft -= n;
+	}
+}
+
+#ifdef BDELTA_HAVE_MMAP
+// Writes output as spans of memory gathered into large pwritev() batches.
+// Long copies from the reference are done by copy_file_range() where the
+// kernel supports it, so that the data never leaves the page cache.
+class BatchOutput {
+public:
+	static const int maxSpans = 64;
+	static const size_t maxBytes = 8 << 20;
+	static const uint64_t minCopyRange = 64 << 10;
+
+	BatchOutput(int fd, uint64_t pos) {
+		this->fd = fd;
+		this->pos = pos;
+		numspans = 0;
+		bytes = 0;
+		useCopyRange = true;
+	}
+
+	void write(const void *data, uint64_t num) {
+		while (num) {
+			size_t n = (size_t)std::min(num, (uint64_t)maxBytes);
+			spans[numspans].iov_base = (void *)data;
+			spans[numspans].iov_len = n;
+			++numspans;
+			bytes += n;
+			if (numspans == maxSpans || bytes >= maxBytes) flush();
+			data = (const char *)data + n;
+			num -= n;
+		}
+	}
+
+	// Copies num bytes at refpos of the reference file reffd, which is also
+	// mapped at refdata.
+	void copy(int reffd, const char *refdata, uint64_t refpos, uint64_t num) {
+#ifdef BDELTA_HAVE_COPY_FILE_RANGE
+		if (useCopyRange && num >= minCopyRange) {
+			flush();
+			loff_t in = refpos, out = pos;
+			while (num) {
+				ssize_t r = copy_file_range(reffd, &in, fd, &out, (size_t)std::min<uint64_t>(num, 1 << 30), 0);
+				if (r < 0 && errno == EINTR) continue;
+				if (r <= 0) {
+					// Unsupported here (e.g. across filesystems); write the rest normally.
+					useCopyRange = false;
+					break;
+				}
+				num -= r;
+				refpos += r;
+				pos += r;
+			}
+			if (!num) return;
+		}
+#endif
+		write(refdata + refpos, num);
+	}
+
+	void flush() {
+		int first = 0;
+		while (first < numspans) {
+#ifdef BDELTA_HAVE_PWRITEV
+			ssize_t r = pwritev(fd, spans + first, numspans - first, pos);
+#else
+			ssize_t r = pwrite(fd, spans[first].iov_base, spans[first].iov_len, pos);
+#endif
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) throw "write error: could not write output.  Possibly out of space";
+			pos += r;
+			// Step over what was written, which may end part way through a span.
+			while (first < numspans && (size_t)r >= spans[first].iov_len) {
+				r -= spans[first].iov_len;
+				++first;
+			}
+			if (r) {
+				spans[first].iov_base = (char *)spans[first].iov_base + r;
+				spans[first].iov_len -= r;
+			}
+		}
+		numspans = 0;
+		bytes = 0;
+	}
+
+private:
+	int fd;
+	uint64_t pos;
+	struct iovec spans[maxSpans];
+	int numspans;
+	size_t bytes;
+	bool useCopyRange;
+};
+#endif
+
+// Reads and writes at given positions.  Several threads may use one at
+// once where there are pread() and pwrite().
+class RandomAccess {
+public:
+#ifdef BDELTA_HAVE_MMAP
+	static const bool concurrent = true;
+#else
+	static const bool concurrent = false;
+#endif
+
+	// A sequential one, such as for a pipe, can only be written in order, from
+	// one thread.
+	RandomAccess(FILE *f, bool sequential = false) {
+		this->f = f;
+		this->sequential = sequential;
+	}
+	void read(void *buf, size_t num, uint64_t pos) {
+#ifdef BDELTA_HAVE_MMAP
+		char *p = (char *)buf;
+		while (num) {
+			ssize_t r = pread(fileno(f), p, num, (off_t)pos);
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) throw "read error: unexpected end of file";
+			p += r;
+			pos += r;
+			num -= r;
+		}
+#else
+		fseek64(f, pos, SEEK_SET);
+		fread_fixed(f, buf, num);
+#endif
+	}
+	void write(const void *buf, size_t num, uint64_t pos) {
+		if (sequential) {
+			fwrite_fixed(f, buf, num);
+			return;
+		}
+#ifdef BDELTA_HAVE_MMAP
+		const char *p = (const char *)buf;
+		while (num) {
+			ssize_t r = pwrite(fileno(f), p, num, (off_t)pos);
+			if (r < 0 && errno == EINTR) continue;
+			if (r <= 0) throw "write error: could not write output.  Possibly out of space";
+			p += r;
+			pos += r;
+			num -= r;
+		}
+#else
+		fseek64(f, pos, SEEK_SET);
+		fwrite_fixed(f, buf, num);
+#endif
+	}
+
+private:
+	FILE *f;
+	bool sequential;
+};
+
+// The reference files, read as one file: their concatenation.  Each is
+// mapped where it can be, and read through stdio where it can't.
+class References {
+public:
+	std::vector<uint64_t> sizes; // Of each file
+	uint64_t size; // Of them all
+	bool listed; // Whether the patch lists several, which read_sizes() checks
+
+	References(const std::vector<const char *> &paths) {
+		size = 0;
+		listed = false;
+		for (size_t i = 0; i < paths.size(); ++i) {
+			Part part;
+			part.f = fopen(paths[i], "rb");
+			if (!part.f) throw "couldn't open a reference file";
+			part.start = size;
+			part.size = getLenOfFile(paths[i]);
+			part.data = (const char *)map_file(part.f, part.size);
+			parts.push_back(part);
+			sizes.push_back(part.size);
+			size += part.size;
+		}
+	}
+	~References() {
+		for (size_t i = 0; i < parts.size(); ++i) {
+			unmap_file(parts[i].data, parts[i].size);
+			fclose(parts[i].f);
+		}
+	}
+
+	bool mapped() const {
+		for (size_t i = 0; i < parts.size(); ++i)
+			if (!parts[i].data) return false;
+		return true;
+	}
+
+	// Reads the reference sizes that follow file 1's in a patch made
+	// against several.
+	void read_sizes(BufferedReader &patch) const {
+		if (!listed) {
+			if (sizes.size() > 1) throw "the patch was made against a single reference file";
+			return;
+		}
+		if (patch.read_varint() != sizes.size()) throw "the patch was made against a different number of reference files";
+		for (size_t i = 0; i < sizes.size(); ++i)
+			if (patch.read_varint() != sizes[i]) throw "reference files are not the ones the patch was made from";
+	}
+
+	// Copies num bytes at pos to outfile.  Returns false if they can't all
+	// be read.
+	bool copy(FILE *outfile, uint64_t pos, uint64_t num) {
+		bool ok = true;
+		each(pos, num, [&](Part &part, uint64_t at, uint64_t n) {
+			if (part.data)
+				fwrite_fixed(outfile, part.data + at, n);
+			else {
+				fseek64(part.f, at, SEEK_SET);
+				ok = ok && copy_bytes_to_file(part.f, outfile, n);
+			}
+		});
+		return ok;
+	}
+	// Reads num bytes at pos into buf; several threads at once if
+	// RandomAccess::concurrent.
+	void read(void *buf, size_t num, uint64_t pos) {
+		char *p = (char *)buf;
+		each(pos, num, [&](Part &part, uint64_t at, uint64_t n) {
+			if (part.data)
+				memcpy(p, part.data + at, (size_t)n);
+			else
+				RandomAccess(part.f).read(p, (size_t)n, at);
+			p += n;
+		});
+	}
+#ifdef BDELTA_HAVE_MMAP
+	// Copies num bytes at pos to out; only if mapped().
+	void copy(BatchOutput &out, uint64_t pos, uint64_t num) {
+		each(pos, num, [&](Part &part, uint64_t at, uint64_t n) {
+			out.copy(fileno(part.f), part.data, at, n);
+		});
+	}
+#endif
+
+private:
+	struct Part {
+		FILE *f;
+		const char *data; // NULL if not mapped
+		uint64_t start, size;
+	};
+	std::vector<Part> parts;
+
+	// Calls f(part, offset, num) for each piece of [pos, pos + num) that
+	// lies in one file, in order.  The range must be within size.
+	template <class F>
+	void each(uint64_t pos, uint64_t num, F f) {
+		size_t i = 0;
+		while (i + 1 < parts.size() && parts[i + 1].start <= pos) ++i;
+		for (; num; ++i) {
+			uint64_t at = pos - parts[i].start,
+			         n = std::min(num, parts[i].size - at);
+			if (n) f(parts[i], at, n);
+			pos += n;
+			num -= n;
+		}
+	}
+	References(const References &);
+	References &operator=(const References &);
+};
+
+// Checks a copy from the reference, given relative to the end of the last one.
+static bool next_ref_copy(uint64_t &refpos, uint64_t copyloc, uint64_t num, uint64_t reflen) {
+	refpos += copyloc;
+	return refpos <= reflen && num <= reflen - refpos;
+}
+
+// Writes the output from records of (copyloc1, copyloc2, copynum), reading
+// unmatched data through the patch reader.  refpos is where the last copy
+// from the reference ended, carried between calls for the same output.
+bool apply_stream(const uint64_t *records, unsigned numrecords, BufferedReader &patch,
+		References &ref, FILE *outfile, uint64_t &refpos) {
+	for (unsigned i = 0; i < numrecords; ++i) {
+		uint64_t copyloc1 = records[3 * i],
+		         copyloc2 = records[3 * i + 1],
+		         copynum = records[3 * i + 2];
+		copy_bytes_to_file(patch, outfile, copyloc2);
+
+		if (!next_ref_copy(refpos, copyloc1, copynum, ref.size) || !ref.copy(outfile, refpos, copynum))
+			return false;
+		refpos += copynum;
+	}
+	return true;
+}
+
+#ifdef BDELTA_HAVE_MMAP
+// As apply_stream(), with the patch and reference both mapped.  Unmatched
+// data starts at litpos in the patch.
+bool apply_mapped(const uint64_t *records, unsigned numrecords,
+		const char *patchdata, uint64_t patchlen, uint64_t litpos,
+		References &ref, int outfd) {
+	BatchOutput out(outfd, 0);
+	uint64_t refpos = 0;
+	for (unsigned i = 0; i < numrecords; ++i) {
+		uint64_t copyloc1 = records[3 * i],
+		         copyloc2 = records[3 * i + 1],
+		         copynum = records[3 * i + 2];
+		if (litpos > patchlen || copyloc2 > patchlen - litpos)
+			throw "read error: unexpected end of file";
+		out.write(patchdata + litpos, copyloc2);
+		litpos += copyloc2;
+
+		if (!next_ref_copy(refpos, copyloc1, copynum, ref.size))
+			return false;
+		ref.copy(out, refpos, copynum);
+		refpos += copynum;
+	}
+	out.flush();
+	return true;
+}
+#endif
+
+// Reads the header and match records of a version 1 patch, after the
+// version.  Match records are (copyloc1, copyloc2, copynum) triples,
+// decoded in one go, with room for one extra record to cover data after
+// the last match.
+uint64_t *read_records_v1(BufferedReader &patch, uint64_t &size2, unsigned &nummatches) {
+	char intsize;
+	patch.read(&intsize, 1);
+	if (intsize != 4 && intsize != 8) {
+		fprintf(stderr, "unsupported file pointer size\n");
+		return NULL;
+	}
+	patch.read_uint(intsize); // size1
+	size2 = patch.read_uint(intsize);
+	nummatches = (unsigned)patch.read_uint(intsize);
+
+	uint64_t *records = new uint64_t[3 * ((uint64_t)nummatches + 1)];
+	patch.read_uints(records, 3 * (uint64_t)nummatches, intsize);
+	// Relative reference offsets are signed; widen 32-bit ones accordingly.
+	if (intsize == 4)
+		for (unsigned i = 0; i < nummatches; ++i)
+			records[3 * i] = (uint64_t)(int64_t)(int32_t)records[3 * i];
+	return records;
+}
+
+// Reads a match count and the three varint columns of that many records,
+// as stored by versions 2 and 4, leaving room for one more record.
+uint64_t *read_columns(BufferedReader &patch, unsigned &nummatches) {
+	uint64_t n = patch.read_varint();
+	nummatches = (unsigned)n;
+	if (nummatches != n) throw "read error: too many matches";
+	uint64_t *records = new uint64_t[3 * ((uint64_t)nummatches + 1)];
+	uint64_t columnSize[3];
+	for (unsigned c = 0; c < 3; ++c)
+		columnSize[c] = patch.read_varint();
+	std::vector<unsigned char> column;
+	for (unsigned c = 0; c < 3; ++c) {
+		if (columnSize[c] != (size_t)columnSize[c]) throw "read error: corrupt match records";
+		column.resize((size_t)columnSize[c]);
+		patch.read(column.empty() ? NULL : &column[0], columnSize[c]);
+		const unsigned char *p = column.empty() ? NULL : &column[0], *end = p + column.size();
+		for (unsigned i = 0; i < nummatches; ++i)
+			if (!decode_varint(p, end, records[3 * i + c]))
+				throw "read error: corrupt match records";
+		if (p != end) throw "read error: corrupt match records";
+	}
+	return records;
+}
+
+// As read_records_v1(), for version 2, whose records are stored as three
+// columns of varints.
+uint64_t *read_records_v2(BufferedReader &patch, const References &ref, uint64_t &size2, unsigned &nummatches) {
+	patch.read_varint(); // size1
+	ref.read_sizes(patch);
+	size2 = patch.read_varint();
+	uint64_t *records = read_columns(patch, nummatches);
+	for (unsigned i = 0; i < nummatches; ++i)
+		records[3 * i] = zigzag_decode(records[3 * i]);
+	return records;
+}
+
+// A version 4 patch: chunk i holds bytes i * chunkSize onwards of the new
+// file, and is stored from offsets[i] to offsets[i + 1] of the patch.
+struct ChunkedPatch {
+	uint64_t size1, size2, chunkSize;
+	std::vector<uint64_t> offsets;
+	uint64_t numChunks() const {return offsets.size() - 1;}
+};
+
+static void corrupt() {throw "read error: corrupt patch";}
+
+// Reads the header and chunk index of a version 4 patch, after the version.
+void read_chunked(BufferedReader &patch, const References &ref, RandomAccess &file, uint64_t patchlen, ChunkedPatch &cp) {
+	cp.size1 = patch.read_varint();
+	ref.read_sizes(patch);
+	cp.size2 = patch.read_varint();
+	cp.chunkSize = patch.read_varint();
+	uint64_t pos = patch.tell();
+	if (!cp.chunkSize || patchlen < pos + 8) corrupt();
+
+	unsigned char footer[8];
+	uint64_t indexPos;
+	file.read(footer, 8, patchlen - 8);
+	decode_uints(&indexPos, footer, 1, 8);
+	if (indexPos < pos || indexPos > patchlen - 8) corrupt();
+	std::vector<unsigned char> index((size_t)(patchlen - 8 - indexPos));
+	if (!index.empty()) file.read(&index[0], index.size(), indexPos);
+
+	const unsigned char *p = index.empty() ? NULL : &index[0], *end = p + index.size();
+	uint64_t numChunks, bytes;
+	if (!decode_varint(p, end, numChunks) || numChunks != (cp.size2 + cp.chunkSize - 1) / cp.chunkSize)
+		corrupt();
+	cp.offsets.assign(1, pos);
+	for (uint64_t i = 0; i < numChunks; ++i) {
+		if (!decode_varint(p, end, bytes) || bytes > indexPos - pos) corrupt();
+		pos += bytes;
+		cp.offsets.push_back(pos);
+	}
+	if (p != end || pos != indexPos) corrupt();
+}
+
+// Applies a version 4 patch read in order, after the version, as
+// apply_stream() does, so the patch needn't be seekable.  The chunk index
+// at the end isn't needed.
+bool apply_chunked_stream(BufferedReader &patch, References &ref, FILE *outfile) {
+	uint64_t size1 = patch.read_varint();
+	ref.read_sizes(patch);
+	uint64_t size2 = patch.read_varint(),
+	         chunkSize = patch.read_varint();
+	if (!chunkSize) corrupt();
+	if (size1 != ref.size) return false;
+	uint64_t refpos = 0;
+	for (uint64_t start = 0; start < size2; start += chunkSize) {
+		uint64_t left = std::min(chunkSize, size2 - start);
+		unsigned nummatches;
+		uint64_t *records = read_columns(patch, nummatches);
+		// Make the chunk's absolute reference locations relative.
+		uint64_t last = refpos;
+		for (unsigned i = 0; i < nummatches; ++i) {
+			uint64_t *r = &records[3 * i];
+			if (r[1] > left || r[2] > left - r[1]) corrupt();
+			left -= r[1] + r[2];
+			uint64_t p1 = r[0];
+			r[0] = p1 - last;
+			last = p1 + r[2];
+		}
+		uint64_t *r = &records[3 * nummatches];
+		r[0] = 0; r[1] = left; r[2] = 0;
+		bool ok = apply_stream(records, nummatches + 1, patch, ref, outfile, refpos);
+		delete [] records;
+		if (!ok) return false;
+	}
+	return true;
+}
+
+// Rebuilds bytes rangeStart to rangeEnd of the new file, or the part of
+// them within one chunk, writing them from the start of out.
+class ChunkApplier {
+public:
+	ChunkApplier(const ChunkedPatch &cp, RandomAccess &patch, References &ref, RandomAccess &out,
+			uint64_t rangeStart, uint64_t rangeEnd)
+		: cp(cp), patch(patch), ref(ref), out(out), rangeStart(rangeStart), rangeEnd(rangeEnd) {}
+
+	void apply(uint64_t chunk) {
+		uint64_t place = chunk * cp.chunkSize,
+		         end = std::min(place + cp.chunkSize, cp.size2);
+		data.resize((size_t)(cp.offsets[chunk + 1] - cp.offsets[chunk]));
+		if (!data.empty()) patch.read(&data[0], data.size(), cp.offsets[chunk]);
+		const unsigned char *p = data.empty() ? NULL : &data[0], *dataEnd = p + data.size();
+
+		uint64_t count, columnSize[3];
+		if (!decode_varint(p, dataEnd, count)) corrupt();
+		const unsigned char *column[3], *columnEnd[3];
+		for (unsigned c = 0; c < 3; ++c)
+			if (!decode_varint(p, dataEnd, columnSize[c])) corrupt();
+		for (unsigned c = 0; c < 3; ++c) {
+			if (columnSize[c] > (uint64_t)(dataEnd - p)) corrupt();
+			column[c] = p;
+			columnEnd[c] = p += columnSize[c];
+		}
+		const unsigned char *literal = p;
+
+		for (uint64_t i = 0; i < count; ++i) {
+			uint64_t p1, gap, num;
+			if (!decode_varint(column[0], columnEnd[0], p1) ||
+					!decode_varint(column[1], columnEnd[1], gap) ||
+					!decode_varint(column[2], columnEnd[2], num))
+				corrupt();
+			if (gap > end - place || gap > (uint64_t)(dataEnd - literal)) corrupt();
+			put(place, literal, gap);
+			literal += gap;
+			place += gap;
+			if (num > end - place || p1 > cp.size1 || num > cp.size1 - p1) corrupt();
+			copy(place, p1, num);
+			place += num;
+		}
+		if (end - place != (uint64_t)(dataEnd - literal)) corrupt();
+		put(place, literal, end - place);
+	}
+
+private:
+	const ChunkedPatch &cp;
+	RandomAccess &patch;
+	References &ref;
+	RandomAccess &out;
+	uint64_t rangeStart, rangeEnd;
+	std::vector<unsigned char> data, buf;
+
+	// Clips [place, place + num) to the range.  Returns false if none of it
+	// is inside.
+	bool clip(uint64_t &place, uint64_t &num, uint64_t &skip) {
+		uint64_t from = std::max(place, rangeStart), to = std::min(place + num, rangeEnd);
+		if (from >= to) return false;
+		skip = from - place;
+		place = from;
+		num = to - from;
+		return true;
+	}
+	void put(uint64_t place, const unsigned char *src, uint64_t num) {
+		uint64_t skip;
+		if (clip(place, num, skip))
+			out.write(src + skip, (size_t)num, place - rangeStart);
+	}
+	void copy(uint64_t place, uint64_t refpos, uint64_t num) {
+		uint64_t skip;
+		if (!clip(place, num, skip)) return;
+		refpos += skip;
+		buf.resize(1 << 20);
+		while (num) {
+			size_t n = (size_t)std::min<uint64_t>(num, buf.size());
+			ref.read(&buf[0], n, refpos);
+			out.write(&buf[0], n, place - rangeStart);
+			refpos += n;
+			place += n;
+			num -= n;
+		}
+	}
+};
+
+// Applies the chunks of a version 4 patch that overlap the range, on up to
+// numThreads threads.
+void apply_chunked(const ChunkedPatch &cp, RandomAccess &patch, References &ref, RandomAccess &out,
+		uint64_t rangeStart, uint64_t rangeEnd, unsigned numThreads) {
+	if (rangeStart >= rangeEnd) return;
+	uint64_t first = rangeStart / cp.chunkSize,
+	         last = (rangeEnd - 1) / cp.chunkSize + 1;
+	if (!RandomAccess::concurrent) numThreads = 1;
+	if (numThreads > last - first) numThreads = (unsigned)(last - first);
+	if (numThreads <= 1) {
+		ChunkApplier applier(cp, patch, ref, out, rangeStart, rangeEnd);
+		for (uint64_t i = first; i < last; ++i)
+			applier.apply(i);
+		return;
+	}
+
+	std::atomic<uint64_t> next(first);
+	const char *error = NULL;
+	std::mutex errorLock;
+	std::vector<std::thread> threads;
+	for (unsigned t = 0; t < numThreads; ++t)
+		threads.push_back(std::thread([&]() {
+			ChunkApplier applier(cp, patch, ref, out, rangeStart, rangeEnd);
+			try {
+				for (uint64_t i; (i = next++) < last; )
+					applier.apply(i);
+			} catch (const char *desc) {
+				std::lock_guard<std::mutex> lock(errorLock);
+				if (!error) error = desc;
+				next = last;
+			}
+		}));
+	for (size_t t = 0; t < threads.size(); ++t)
+		threads[t].join();
+	if (error) throw error;
+}
+
 int main(int argc, char **argv) {
 	try {
+		unsigned numThreads = 1;
+		bool haveRange = false;
+		uint64_t rangeStart = 0, rangeLen = 0;
+		std::vector<const char *> refNames; // After the old file, with --ref
+		while (argc > 1 && argv[1][0] == '-') {
+			if (strcmp(argv[1], "-j") == 0 && argc > 2) {
+				numThreads = atoi(argv[2]);
+				if (numThreads == 0) numThreads = 1;
+			} else if (strcmp(argv[1], "--range") == 0 && argc > 2) {
+				char *colon;
+				rangeStart = strtoull(argv[2], &colon, 10);
+				if (*colon != ':') {
+					printf("--range needs start:length\n");
+					return 1;
+				}
+				rangeLen = strtoull(colon + 1, NULL, 10);
+				haveRange = true;
+			} else if (strcmp(argv[1], "--ref") == 0 && argc > 2) {
+				refNames.push_back(argv[2]);
+			} else
+				break;
+			argc -= 2;
+			argv += 2;
+		}
 		if (argc != 4) {
-			printf("usage: bpatch <oldfile> <newfile> <patchfile>\n");
+			printf("usage: bpatch [-j threads] [--range start:length] [--ref <reffile>]... <oldfile> <newfile> <patchfile>\n");
 			printf("needs a reference file, file to output, and patchfile:\n");
+			printf("a newfile of - writes to stdout, and a patchfile of - reads from stdin\n");
+			printf("-j and --range need a chunked patch (bdelta --chunk-size); --range writes only\n");
+			printf("that part of the new file.  Each --ref is another reference, in the order given to bdelta\n");
 			return 1;
 		}
 
-		if (!fileExists(argv[1]) || !fileExists(argv[3])) {
-			printf("one of the input files does not exist\n");
+		// "-" reads the patch from stdin, or writes the new file to stdout.
+		// Either way the patch is applied in one pass, in order.
+		bool patchPiped = strcmp(argv[3], "-") == 0,
+		     outPiped = strcmp(argv[2], "-") == 0;
+		refNames.insert(refNames.begin(), argv[1]);
+		bool missing = !patchPiped && !fileExists(argv[3]);
+		for (size_t i = 0; i < refNames.size(); ++i)
+			missing |= !fileExists(refNames[i]);
+		if (missing) {
+			fprintf(stderr, "one of the input files does not exist\n");
 			return 1;
 		}
 
-		FILE *patchfile = fopen(argv[3], "rb");
+		FILE *patchfile = patchPiped ? stdin : fopen(argv[3], "rb");
+		if (patchPiped) set_binary_mode(stdin);
+		BufferedReader patch(patchfile);
 		char magic[3];
-		fread_fixed(patchfile, magic, 3);
+		patch.read(magic, 3);
 		if (strncmp(magic, "BDT", 3)) {
-			printf("Given file is not a recognized patchfile\n");
+			fprintf(stderr, "Given file is not a recognized patchfile\n");
 			return 1;
 		}
-		unsigned short version = read_word(patchfile);
-		if (version != 1) {
-			printf("unsupported patch version\n");
+		unsigned short version = patch.read_word();
+		bool listed = (version & multipleReferences) != 0;
+		version &= ~multipleReferences;
+		if (version < 1 || version > 4 || (listed && version == 1)) {
+			fprintf(stderr, "unsupported patch version\n");
 			return 1;
 		}
-		char intsize;
-		fread_fixed(patchfile, &intsize, 1);
-		if (intsize != 4) {
-			printf("unsupported file pointer size\n");
+		if (haveRange && (version != 4 || patchPiped)) {
+			fprintf(stderr, "--range needs a chunked patch, not read from stdin\n");
 			return 1;
 		}
-		unsigned size1 = read_dword(patchfile),
-			size2 = read_dword(patchfile);
 
-		unsigned nummatches = read_dword(patchfile);
-
-		unsigned * copyloc1 = new unsigned[nummatches + 1];
-		unsigned * copyloc2 = new unsigned[nummatches + 1];
-		unsigned *  copynum = new unsigned[nummatches + 1];
-
-		for (unsigned i = 0; i < nummatches; ++i) {
-			copyloc1[i] = read_dword(patchfile);
-			copyloc2[i] = read_dword(patchfile);
-			copynum[i] = read_dword(patchfile);
-			size2 -= copyloc2[i] + copynum[i];
+		References ref(refNames);
+		ref.listed = listed;
+		if (version == 1 && refNames.size() > 1) {
+			fprintf(stderr, "the patch was made against a single reference file\n");
+			return 1;
 		}
-		if (size2) {
-			copyloc1[nummatches] = 0; copynum[nummatches] = 0;
-			copyloc2[nummatches] = size2;
-			++nummatches;
+		FILE *outfile = outPiped ? stdout : fopen(argv[2], "wb");
+		if (!outfile) {
+			fprintf(stderr, "couldn't open output file\n");
+			return 1;
 		}
+		if (outPiped) set_binary_mode(stdout);
 
-		FILE *ref = fopen(argv[1], "rb");
-		FILE *outfile = fopen(argv[2], "wb");
+		if (version == 4 && !patchPiped) {
+			RandomAccess patchio(patchfile), outio(outfile, outPiped);
+			ChunkedPatch cp;
+			read_chunked(patch, ref, patchio, getLenOfFile(argv[3]), cp);
+			if (ref.size != cp.size1) {
+				fprintf(stderr, "reference file is not the one the patch was made from\n");
+				return 1;
+			}
+			uint64_t rangeEnd = cp.size2;
+			if (haveRange) {
+				rangeStart = std::min(rangeStart, cp.size2);
+				rangeEnd = rangeStart + std::min(rangeLen, cp.size2 - rangeStart);
+			}
+			apply_chunked(cp, patchio, ref, outio, rangeStart, rangeEnd, outPiped ? 1 : numThreads);
+			fclose(outfile);
+			return 0;
+		}
 
-		for (unsigned i = 0; i < nummatches; ++i) {
-			if (!copy_bytes_to_file(patchfile, outfile, copyloc2[i])) {
-				printf("Error.  patchfile is truncated\n");
-				return -1;
+		bool ok;
+		if (version == 4) {
+			ok = apply_chunked_stream(patch, ref, outfile);
+		} else {
+			// Version 3 is version 2 compressed; the rest is read through unpacked.
+			Decompressor *decompressor = NULL;
+			BufferedReader *unpacked = NULL;
+			if (version == 3) {
+				unsigned char codec;
+				patch.read(&codec, 1);
+				decompressor = Decompressor::create(codec, patch);
+				unpacked = new BufferedReader(decompressor);
 			}
+			BufferedReader &in = unpacked ? *unpacked : patch;
 
-			int copyloc = copyloc1[i];
-			fseek(ref, copyloc, SEEK_CUR);
+			uint64_t * records;
+			unsigned nummatches;
+			uint64_t size2;
+			if (version == 1)
+				records = read_records_v1(in, size2, nummatches);
+			else
+				records = read_records_v2(in, ref, size2, nummatches);
+			if (!records) return 1;
 
-			if (!copy_bytes_to_file(ref, outfile, copynum[i])) {
-				printf("Error while copying from reference file\n");
-				return -1;
+			for (unsigned i = 0; i < nummatches; ++i) {
+				uint64_t *r = &records[3 * i];
+				size2 -= r[1] + r[2];
 			}
+			if (size2) {
+				uint64_t *r = &records[3 * nummatches];
+				r[0] = 0; r[1] = size2; r[2] = 0;
+				++nummatches;
+			}
+
+#ifdef BDELTA_HAVE_MMAP
+			// Mapping the patch and writing by position need real files.
+			uint64_t patchlen = patchPiped ? 0 : getLenOfFile(argv[3]);
+			const char *patchdata = ref.mapped() && !unpacked && !patchPiped && !outPiped ?
+				(const char *)map_file(patchfile, patchlen) : NULL;
+			if (patchdata) {
+				uint64_t litpos = patch.tell();
+				ok = apply_mapped(records, nummatches, patchdata, patchlen, litpos,
+					ref, fileno(outfile));
+				unmap_file(patchdata, patchlen);
+			} else
+#endif
+			{
+				uint64_t refpos = 0;
+				ok = apply_stream(records, nummatches, in, ref, outfile, refpos);
+			}
+
+			delete [] records;
+			delete unpacked;
+			delete decompressor;
+		}
+		if (!ok) {
+			fprintf(stderr, "Error while copying from reference file\n");
+			return -1;
 		}
 
-		delete [] copynum;
-		delete [] copyloc2;
-		delete [] copyloc1;
+		if (fflush(outfile))
+			throw "write error: could not write output.  Possibly out of space";
+		if (!outPiped) fclose(outfile);
 
 	} catch (const char * desc){
 		fprintf (stderr, "FATAL: %s\n", desc);
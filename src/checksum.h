@@ -2,30 +2,63 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
-struct Hash {
+// Rolling hashes over a window of blocksize tokens, used as policies by the
+// pass code.  Each is a template on the token type, and provides
+//
+//   Hash::Token;                // The token type
+//   Hash::Window w(blocksize);  // Whatever depends only on blocksize, made once per pass
+//   Hash h(w, buf);             // Hash of buf[0] .. buf[blocksize - 1]
+//   h.advance(out, in);         // Slide the window on by one token
+//   h.getValue();
+//
+// and all of them produce 64-bit values.  Which one is used is chosen by
+// the BDELTA_HASH_* pass flags.  A policy whose fixedBlocksize is nonzero
+// only handles that blocksize, which callers may then treat as a constant.
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#define BDELTA_CRC32C_X86 1
+	#include <nmmintrin.h>
+#endif
+
+// Multiply-by-181 polynomial hash; the default.  With FixedBlocksize set,
+// the window loop has a constant trip count and oldCoefficient is a
+// compile-time constant.
+template <class TokenType, unsigned FixedBlocksize>
+struct BasicPolynomialHash {
 public:
+	typedef TokenType Token;
 	typedef uint64_t Value;
-	Hash() {}
-	Hash(const Token *buf, unsigned blocksize) {
+	static const unsigned fixedBlocksize = FixedBlocksize;
+	struct Window {
+		unsigned blocksize;
+		uint64_t oldCoefficient;
+		Window(unsigned blocksize) {
+			this->blocksize = blocksize;
+			oldCoefficient = powHash(multiplyAmount, blocksize);
+		}
+	};
+	BasicPolynomialHash() {}
+	BasicPolynomialHash(const Window &w, const Token *buf) {
+		const unsigned blocksize = FixedBlocksize ? FixedBlocksize : w.blocksize;
 		value = 0;
 		for (unsigned num = 0; num < blocksize; ++num)
 			advance_add(buf[num]);
-		oldCoefficient = powHash(multiplyAmount, blocksize);
+		oldCoefficient = FixedBlocksize ? fixedCoefficient : w.oldCoefficient;
 	}
 	void advance(Token out, Token in) {
 		advance_remove(out);
 		advance_add(in);
 	}
-	static unsigned modulo(Value hash, unsigned d) {
-		// Assumes d is power of 2.
-		return hash & (d - 1);
-	}
 	Value getValue() {return value >> extraProcBits;}
 private:
 	typedef uint64_t ProcValue;
 	static const unsigned extraProcBits = (sizeof(ProcValue) - sizeof(Value)) * 8;
 
 	static const ProcValue multiplyAmount = (1ll << extraProcBits) | 181;
+	static constexpr ProcValue constPowHash(ProcValue x, unsigned y) {
+		return y ? (y & 1 ? x : 1) * constPowHash(x * x, y >> 1) : 1;
+	}
+	static constexpr ProcValue fixedCoefficient = constPowHash(multiplyAmount, FixedBlocksize);
 	ProcValue oldCoefficient, value;
 
 	void advance_add(Token in) {
@@ -33,7 +66,7 @@ private:
 		value *= multiplyAmount;
 	}
 	void advance_remove(Token out) {
-		value -= out * oldCoefficient;
+		value -= out * (FixedBlocksize ? fixedCoefficient : oldCoefficient);
 	}
 	static ProcValue powHash(ProcValue x, unsigned y) {
 		ProcValue res = 1;
@@ -45,4 +78,156 @@ private:
 		return res;
 	}
 };
+template <class Token>
+using PolynomialHash = BasicPolynomialHash<Token, 0>;
+
+static inline uint64_t rotl64(uint64_t x, unsigned r) {
+	r &= 63;
+	return r ? (x << r) | (x >> (64 - r)) : x;
+}
+
+static const uint64_t *make_buzhash_table() {
+	static uint64_t table[256];
+	uint64_t x = 0;
+	for (unsigned i = 0; i < 256; ++i) {
+		// splitmix64
+		uint64_t z = (x += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		table[i] = z ^ (z >> 31);
+	}
+	return table;
+}
+static const uint64_t *const buzhashTable = make_buzhash_table();
+
+// Buzhash (cyclic polynomial): a table lookup, rotate and xor per token,
+// with no multiplies.
+template <class TokenType>
+struct BuzHash {
+public:
+	typedef TokenType Token;
+	typedef uint64_t Value;
+	static const unsigned fixedBlocksize = 0;
+	struct Window {
+		unsigned blocksize;
+		Window(unsigned blocksize) {this->blocksize = blocksize;}
+	};
+	BuzHash() {}
+	BuzHash(const Window &w, const Token *buf) {
+		value = 0;
+		for (unsigned num = 0; num < w.blocksize; ++num)
+			value = rotl64(value, 1) ^ tokenValue(buf[num]);
+		outRotate = w.blocksize & 63;
+	}
+	void advance(Token out, Token in) {
+		value = rotl64(value, 1) ^ rotl64(tokenValue(out), outRotate) ^ tokenValue(in);
+	}
+	Value getValue() {return value;}
+private:
+	uint64_t value;
+	unsigned outRotate;
+
+	static uint64_t tokenValue(Token t) {
+		uint64_t v = buzhashTable[t & 0xff];
+		for (unsigned i = 1; i < sizeof(Token); ++i)
+			v ^= rotl64(buzhashTable[(t >> (8 * i)) & 0xff], 8 * i);
+		return v;
+	}
+};
+
+static const uint32_t *make_crc32c_table() {
+	static uint32_t table[256];
+	for (unsigned i = 0; i < 256; ++i) {
+		uint32_t c = i;
+		for (unsigned k = 0; k < 8; ++k)
+			c = (c >> 1) ^ (c & 1 ? 0x82F63B78 : 0);
+		table[i] = c;
+	}
+	return table;
+}
+static const uint32_t *const crc32cTable = make_crc32c_table();
+
+#ifdef BDELTA_CRC32C_X86
+// The SSE4.2 instruction, used when the CPU has it whatever the build
+// flags; it takes the token's bytes least significant first.
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_insn(uint32_t crc, uint8_t t) {return _mm_crc32_u8(crc, t);}
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_insn(uint32_t crc, uint16_t t) {return _mm_crc32_u16(crc, t);}
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_insn(uint32_t crc, uint32_t t) {return _mm_crc32_u32(crc, t);}
 
+static bool have_crc32c_insn() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("sse4.2");
+}
+static const bool crc32cInsn = have_crc32c_insn();
+#endif
+
+// CRC32C of the window's bytes, without the usual pre- and post-inversion
+// so that it is linear.  That lets the oldest token's contribution be
+// removed with a lookup in a table made per blocksize.  Uses the SSE4.2
+// instruction when the CPU has it, and a table otherwise; both give the
+// same values.
+template <class TokenType>
+struct Crc32cHash {
+public:
+	typedef TokenType Token;
+	typedef uint64_t Value;
+	static const unsigned fixedBlocksize = 0;
+	struct Window {
+		unsigned blocksize;
+		// out[k][v]: contribution of byte k of the token leaving the window,
+		// once the token coming in has been added.
+		uint32_t out[sizeof(Token)][256];
+		Window(unsigned blocksize) {
+			this->blocksize = blocksize;
+			for (unsigned k = 0; k < sizeof(Token); ++k) {
+				// Linear, so the table follows from the value of each bit.
+				uint64_t zeros = (uint64_t)blocksize * sizeof(Token) + sizeof(Token) - 1 - k;
+				uint32_t bit[8];
+				for (unsigned i = 0; i < 8; ++i) {
+					uint32_t c = update_byte(0, (uint8_t)(1 << i));
+					for (uint64_t z = 0; z < zeros; ++z)
+						c = update_byte(c, 0);
+					bit[i] = c;
+				}
+				for (unsigned v = 0; v < 256; ++v) {
+					uint32_t c = 0;
+					for (unsigned i = 0; i < 8; ++i)
+						if (v & (1 << i)) c ^= bit[i];
+					out[k][v] = c;
+				}
+			}
+		}
+	};
+	Crc32cHash() {}
+	Crc32cHash(const Window &w, const Token *buf) {
+		crc = 0;
+		for (unsigned num = 0; num < w.blocksize; ++num)
+			crc = update(crc, buf[num]);
+		window = &w;
+	}
+	void advance(Token out, Token in) {
+		crc = update(crc, in);
+		for (unsigned k = 0; k < sizeof(Token); ++k)
+			crc ^= window->out[k][(out >> (8 * k)) & 0xff];
+	}
+	Value getValue() {return crc;}
+private:
+	uint32_t crc;
+	const Window *window;
+
+	static uint32_t update_byte(uint32_t crc, uint8_t b) {
+		return (crc >> 8) ^ crc32cTable[(crc ^ b) & 0xff];
+	}
+	// Tokens go in least significant byte first.
+	static uint32_t update(uint32_t crc, Token t) {
+#ifdef BDELTA_CRC32C_X86
+		if (crc32cInsn) return crc32c_insn(crc, t);
+#endif
+		for (unsigned k = 0; k < sizeof(Token); ++k)
+			crc = update_byte(crc, (uint8_t)(t >> (8 * k)));
+		return crc;
+	}
+};
@@ -0,0 +1,239 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Hash table of the block checksums of a pass, looked up once per rolled
+// position in findMatches().
+//
+// It is open-addressed, with one slot per distinct checksum recording up to
+// maxLocs locations in the order they were added.  A checksum added more
+// often than that is too common to be useful: its slot is kept, with no
+// locations, so that it stays excluded.  Slots are grouped into buckets of
+// 16.  Each bucket has 16 one-byte tags, derived from the checksum and kept
+// apart from the slots, so a probe compares a bucket's tags in one go and
+// only reads a slot when its tag matches.  A tag of 0 marks an empty slot.
+//
+// Both structures are flat arrays, so a reference signature can save them
+// and later use them in place from a mapped file; they don't own their
+// arrays then.
+//
+// Include after checksum.h and compare.h.
+
+// Blocked Bloom filter over checksums, about one byte per entry.  Each
+// checksum sets two bits in a single 64-bit word, so a test costs one
+// memory access.  It sits in front of a ChecksumIndex too big for the
+// cache, where most probes from dissimilar data would miss in DRAM.
+struct ChecksumFilter {
+	uint64_t *words;
+	uint64_t numwords;
+	unsigned shift;
+	bool owned;
+
+	ChecksumFilter(uint64_t numentries) {
+		numwords = wordsFor(numentries);
+		setShift();
+		words = new uint64_t[numwords];
+		memset(words, 0, numwords * sizeof(uint64_t));
+		owned = true;
+	}
+	// Uses a filter's words stored elsewhere.
+	ChecksumFilter(uint64_t *words, uint64_t numwords) {
+		this->words = words;
+		this->numwords = numwords;
+		setShift();
+		owned = false;
+	}
+	~ChecksumFilter() {if (owned) delete [] words;}
+
+	static uint64_t wordsFor(uint64_t numentries) {
+		uint64_t n = 1;
+		while (n * 64 < numentries * 8)
+			n *= 2;
+		return n;
+	}
+
+	void add(uint64_t cksum) {
+		uint64_t f = mix(cksum);
+		words[word(f)] |= mask(f);
+	}
+	bool mayContain(uint64_t cksum) const {
+		uint64_t f = mix(cksum), m = mask(f);
+		return (words[word(f)] & m) == m;
+	}
+
+private:
+	void setShift() {
+		shift = 64;
+		for (uint64_t n = numwords; n > 1; n >>= 1) --shift;
+	}
+	// A different multiplier from ChecksumIndex, so the bits are independent
+	// of the bucket and tag.
+	static uint64_t mix(uint64_t cksum) {return (uint64_t)cksum * 0xC2B2AE3D27D4EB4Full;}
+	uint64_t word(uint64_t f) const {return shift == 64 ? 0 : f >> shift;}
+	uint64_t mask(uint64_t f) const {
+		return (1ull << ((f >> (shift - 6)) & 63)) | (1ull << ((f >> (shift - 12)) & 63));
+	}
+
+	ChecksumFilter(const ChecksumFilter &);
+	ChecksumFilter &operator=(const ChecksumFilter &);
+};
+
+template <class Loc>
+struct ChecksumIndex {
+	static const unsigned bucketSlots = 16;
+	static const unsigned maxLocs = 2;
+	static const Loc noLoc = (Loc)-1;
+	static const uint64_t filterMinBytes = 8 << 20; // Tables this big get a ChecksumFilter
+
+	struct Slot {
+		uint64_t cksum;
+		Loc loc[maxLocs]; // noLoc marks unused entries
+	};
+
+	unsigned blocksize;
+	uint64_t bucketMask;
+	unsigned shift;
+	uint64_t numused, capacity; // Slots in use, and the most add() will fill
+	uint8_t *tags;
+	Slot *slots;
+	ChecksumFilter *filter;
+	bool owned;
+
+	// Sized for up to numentries distinct checksums.
+	ChecksumIndex(unsigned blocksize, uint64_t numentries) {
+		this->blocksize = blocksize;
+		uint64_t numbuckets = bucketsFor(numentries);
+		setBuckets(numbuckets);
+		tags = new uint8_t[numbuckets * bucketSlots];
+		slots = new Slot[numbuckets * bucketSlots];
+		memset(tags, 0, numbuckets * bucketSlots);
+		filter = wantsFilter(numbuckets) ? new ChecksumFilter(numentries) : 0;
+		owned = true;
+	}
+	// Uses an index's arrays stored elsewhere.  Takes ownership of filter,
+	// which may be NULL.
+	ChecksumIndex(unsigned blocksize, uint64_t numbuckets, uint8_t *tags, Slot *slots, ChecksumFilter *filter) {
+		this->blocksize = blocksize;
+		setBuckets(numbuckets);
+		this->tags = tags;
+		this->slots = slots;
+		this->filter = filter;
+		owned = false;
+	}
+	~ChecksumIndex() {
+		if (owned) {
+			delete [] tags;
+			delete [] slots;
+		}
+		delete filter;
+	}
+	uint64_t numBuckets() const {return bucketMask + 1;}
+
+	static uint64_t bucketsFor(uint64_t numentries) {
+		uint64_t n = 1;
+		// Keep the table at most 7/8 full.
+		while (n * bucketSlots * 7 < numentries * 8)
+			n *= 2;
+		return n;
+	}
+	static bool wantsFilter(uint64_t numbuckets) {
+		return numbuckets * bucketSlots * (1 + sizeof(Slot)) >= filterMinBytes;
+	}
+
+	// Adds a location; locations must be added in increasing order.  Once
+	// the table is at capacity, new checksums are dropped.  Returns how many
+	// locations this drops, counting those of a checksum that has just
+	// become too common.
+	unsigned add(uint64_t cksum, Loc loc) {
+		if (filter) filter->add(cksum);
+		uint64_t bucket;
+		uint8_t tag;
+		position(cksum, bucket, tag);
+		while (true) {
+			const uint8_t *t = tags + bucket * bucketSlots;
+			for (unsigned m = tagMatches(t, tag); m; m &= m - 1) {
+				Slot &s = slots[bucket * bucketSlots + ctz(m)];
+				if (s.cksum != cksum) continue;
+				if (s.loc[0] == noLoc) return 1; // Already too common
+				for (unsigned i = 1; i < maxLocs; ++i)
+					if (s.loc[i] == noLoc) {s.loc[i] = loc; return 0;}
+				s.loc[0] = noLoc;
+				return maxLocs + 1;
+			}
+			unsigned empty = tagMatches(t, 0);
+			if (empty) {
+				if (numused == capacity) return 1;
+				++numused;
+				unsigned i = ctz(empty);
+				tags[bucket * bucketSlots + i] = tag;
+				Slot &s = slots[bucket * bucketSlots + i];
+				s.cksum = cksum;
+				s.loc[0] = loc;
+				for (unsigned j = 1; j < maxLocs; ++j) s.loc[j] = noLoc;
+				return 0;
+			}
+			bucket = (bucket + 1) & bucketMask;
+		}
+	}
+
+	// Returns the slot for cksum, or NULL if it was never added.  The
+	// slot's locations run up to the first noLoc.
+	const Slot *find(uint64_t cksum) const {
+		if (filter && !filter->mayContain(cksum)) return 0;
+		uint64_t bucket;
+		uint8_t tag;
+		position(cksum, bucket, tag);
+		while (true) {
+			const uint8_t *t = tags + bucket * bucketSlots;
+			for (unsigned m = tagMatches(t, tag); m; m &= m - 1) {
+				const Slot &s = slots[bucket * bucketSlots + ctz(m)];
+				if (s.cksum == cksum) return &s;
+			}
+			if (tagMatches(t, 0)) return 0;
+			bucket = (bucket + 1) & bucketMask;
+		}
+	}
+
+private:
+	void setBuckets(uint64_t numbuckets) {
+		bucketMask = numbuckets - 1;
+		numused = 0;
+		capacity = numbuckets * bucketSlots - numbuckets * bucketSlots / 16;
+		shift = 64;
+		for (uint64_t n = numbuckets; n > 1; n >>= 1) --shift;
+	}
+	// Bucket and tag come from the top bits of a multiplicative mix; the
+	// polynomial checksum's own low bits depend only on the tokens' low bits.
+	void position(uint64_t cksum, uint64_t &bucket, uint8_t &tag) const {
+		uint64_t mixed = (uint64_t)cksum * 0x9E3779B97F4A7C15ull;
+		bucket = shift == 64 ? 0 : (mixed >> shift);
+		tag = (uint8_t)(mixed >> (shift - 8));
+		if (!tag) tag = 1;
+	}
+
+	// Bit i is set if t[i] == tag.
+	static unsigned tagMatches(const uint8_t *t, uint8_t tag) {
+#ifdef BDELTA_COMPARE_X86
+		__m128i v = _mm_loadu_si128((const __m128i *)t);
+		return _mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8((char)tag)));
+#else
+		unsigned m = 0;
+		for (unsigned i = 0; i < bucketSlots; ++i)
+			m |= (unsigned)(t[i] == tag) << i;
+		return m;
+#endif
+	}
+
+	static unsigned ctz(unsigned m) {
+#ifdef __GNUC__
+		return __builtin_ctz(m);
+#else
+		unsigned i = 0;
+		while (!(m & 1)) {m >>= 1; ++i;}
+		return i;
+#endif
+	}
+
+	ChecksumIndex(const ChecksumIndex &);
+	ChecksumIndex &operator=(const ChecksumIndex &);
+};
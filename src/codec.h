@@ -0,0 +1,235 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Streaming compression of version 3 patches.  Each codec is only built
+// when its library is enabled in the Makefile (ZSTD=1, LZ4=1), which
+// defines BDELTA_HAVE_ZSTD or BDELTA_HAVE_LZ4.  Errors are thrown.
+//
+// Include after file.h.
+
+#include <vector>
+
+#ifdef BDELTA_HAVE_ZSTD
+	#include <zstd.h>
+#endif
+#ifdef BDELTA_HAVE_LZ4
+	#include <lz4frame.h>
+#endif
+
+// Codec numbers as stored in the patch header
+enum PatchCodec {CODEC_NONE = 0, CODEC_ZSTD = 1, CODEC_LZ4 = 2};
+
+// Compresses what is written to it into f.  Call finish() once done.
+class Compressor : public ByteSink {
+public:
+	virtual void finish() = 0;
+	// Throws if codec wasn't built in.  level 0 is the codec's default.
+	static Compressor *create(unsigned codec, int level, FILE *f);
+};
+
+// Decompresses the compressed stream that in reads from.
+class Decompressor : public ByteSource {
+public:
+	static Decompressor *create(unsigned codec, BufferedReader &in);
+};
+
+// Returns the codec called name, or -1 if it is unknown.
+inline int codec_by_name(const char *name) {
+	if (strcmp(name, "zstd") == 0) return CODEC_ZSTD;
+	if (strcmp(name, "lz4") == 0) return CODEC_LZ4;
+	return -1;
+}
+
+// Whether codec was built in.
+inline bool codec_supported(int codec) {
+	switch (codec) {
+	case CODEC_NONE: return true;
+#ifdef BDELTA_HAVE_ZSTD
+	case CODEC_ZSTD: return true;
+#endif
+#ifdef BDELTA_HAVE_LZ4
+	case CODEC_LZ4: return true;
+#endif
+	default: return false;
+	}
+}
+
+#ifdef BDELTA_HAVE_ZSTD
+class ZstdCompressor : public Compressor {
+public:
+	ZstdCompressor(int level, FILE *f) {
+		this->f = f;
+		ctx = ZSTD_createCCtx();
+		if (!ctx) throw "zstd: out of memory";
+		if (level) check(ZSTD_CCtx_setParameter(ctx, ZSTD_c_compressionLevel, level));
+		out.resize(ZSTD_CStreamOutSize());
+	}
+	~ZstdCompressor() {ZSTD_freeCCtx(ctx);}
+	void write(const void *data, size_t num) {
+		ZSTD_inBuffer in = {data, num, 0};
+		while (in.pos < in.size)
+			compress(&in, ZSTD_e_continue);
+	}
+	void finish() {
+		ZSTD_inBuffer in = {NULL, 0, 0};
+		while (compress(&in, ZSTD_e_end)) {}
+	}
+
+private:
+	FILE *f;
+	ZSTD_CCtx *ctx;
+	std::vector<unsigned char> out;
+
+	size_t compress(ZSTD_inBuffer *in, ZSTD_EndDirective mode) {
+		ZSTD_outBuffer o = {&out[0], out.size(), 0};
+		size_t left = check(ZSTD_compressStream2(ctx, &o, in, mode));
+		fwrite_fixed(f, &out[0], o.pos);
+		return left;
+	}
+	static size_t check(size_t r) {
+		if (ZSTD_isError(r)) throw ZSTD_getErrorName(r);
+		return r;
+	}
+};
+
+class ZstdDecompressor : public Decompressor {
+public:
+	ZstdDecompressor(BufferedReader &in) : in(in) {
+		ctx = ZSTD_createDCtx();
+		if (!ctx) throw "zstd: out of memory";
+		input.src = NULL;
+		input.size = input.pos = 0;
+	}
+	~ZstdDecompressor() {ZSTD_freeDCtx(ctx);}
+	size_t read(void *buf, size_t num) {
+		ZSTD_outBuffer out = {buf, num, 0};
+		while (out.pos == 0) {
+			if (input.pos == input.size) {
+				unsigned n;
+				input.src = in.next_available(ZSTD_DStreamInSize(), n);
+				input.size = n;
+				input.pos = 0;
+				if (!n) break;
+			}
+			size_t r = ZSTD_decompressStream(ctx, &out, &input);
+			if (ZSTD_isError(r)) throw ZSTD_getErrorName(r);
+		}
+		return out.pos;
+	}
+
+private:
+	BufferedReader &in;
+	ZSTD_DCtx *ctx;
+	ZSTD_inBuffer input;
+};
+#endif
+
+#ifdef BDELTA_HAVE_LZ4
+class Lz4Compressor : public Compressor {
+public:
+	static const size_t chunkSize = 64 << 10;
+
+	Lz4Compressor(int level, FILE *f) {
+		this->f = f;
+		check(LZ4F_createCompressionContext(&ctx, LZ4F_VERSION));
+		memset(&prefs, 0, sizeof(prefs));
+		prefs.compressionLevel = level;
+		out.resize(std::max<size_t>(LZ4F_compressBound(chunkSize, &prefs), LZ4F_HEADER_SIZE_MAX));
+		emit(check(LZ4F_compressBegin(ctx, &out[0], out.size(), &prefs)));
+	}
+	~Lz4Compressor() {LZ4F_freeCompressionContext(ctx);}
+	void write(const void *data, size_t num) {
+		const char *p = (const char *)data;
+		while (num) {
+			size_t n = std::min(num, chunkSize);
+			emit(check(LZ4F_compressUpdate(ctx, &out[0], out.size(), p, n, NULL)));
+			p += n;
+			num -= n;
+		}
+	}
+	void finish() {
+		emit(check(LZ4F_compressEnd(ctx, &out[0], out.size(), NULL)));
+	}
+
+private:
+	FILE *f;
+	LZ4F_cctx *ctx;
+	LZ4F_preferences_t prefs;
+	std::vector<unsigned char> out;
+
+	void emit(size_t num) {fwrite_fixed(f, &out[0], num);}
+	static size_t check(size_t r) {
+		if (LZ4F_isError(r)) throw LZ4F_getErrorName(r);
+		return r;
+	}
+};
+
+class Lz4Decompressor : public Decompressor {
+public:
+	Lz4Decompressor(BufferedReader &in) : in(in) {
+		size_t r = LZ4F_createDecompressionContext(&ctx, LZ4F_VERSION);
+		if (LZ4F_isError(r)) throw LZ4F_getErrorName(r);
+		src = NULL;
+		srcleft = 0;
+	}
+	~Lz4Decompressor() {LZ4F_freeDecompressionContext(ctx);}
+	size_t read(void *buf, size_t num) {
+		size_t got = 0;
+		while (got == 0) {
+			if (!srcleft) {
+				unsigned n;
+				src = in.next_available(64 << 10, n);
+				srcleft = n;
+				if (!n) break;
+			}
+			size_t dstsize = num, srcsize = srcleft;
+			size_t r = LZ4F_decompress(ctx, buf, &dstsize, src, &srcsize, NULL);
+			if (LZ4F_isError(r)) throw LZ4F_getErrorName(r);
+			src += srcsize;
+			srcleft -= srcsize;
+			got = dstsize;
+		}
+		return got;
+	}
+
+private:
+	BufferedReader &in;
+	LZ4F_dctx *ctx;
+	const unsigned char *src;
+	size_t srcleft;
+};
+#endif
+
+Compressor *Compressor::create(unsigned codec, int level, FILE *f) {
+	switch (codec) {
+#ifdef BDELTA_HAVE_ZSTD
+	case CODEC_ZSTD: return new ZstdCompressor(level, f);
+#endif
+#ifdef BDELTA_HAVE_LZ4
+	case CODEC_LZ4: return new Lz4Compressor(level, f);
+#endif
+	default:
+#if !defined(BDELTA_HAVE_ZSTD) && !defined(BDELTA_HAVE_LZ4)
+		(void)level;
+		(void)f;
+#endif
+		throw "this build doesn't support the chosen compression";
+	}
+}
+
+Decompressor *Decompressor::create(unsigned codec, BufferedReader &in) {
+	switch (codec) {
+#ifdef BDELTA_HAVE_ZSTD
+	case CODEC_ZSTD: return new ZstdDecompressor(in);
+#endif
+#ifdef BDELTA_HAVE_LZ4
+	case CODEC_LZ4: return new Lz4Decompressor(in);
+#endif
+	default:
+#if !defined(BDELTA_HAVE_ZSTD) && !defined(BDELTA_HAVE_LZ4)
+		(void)in;
+#endif
+		throw "patch is compressed with a codec this build doesn't support";
+	}
+}
@@ -0,0 +1,143 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Kernels that count how many bytes two buffers have in common, either
+// from the start (forward) or from the end (backward).  They work on bytes
+// so that one set serves every token size; the caller divides by the
+// token size.  The widest kernel the CPU supports is chosen at load time.
+
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) && defined(__SSE2__)
+	#define BDELTA_COMPARE_X86 1
+	#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+	#define BDELTA_COMPARE_NEON 1
+	#include <arm_neon.h>
+#endif
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	#define BDELTA_COMPARE_WORDS 1
+#endif
+
+typedef size_t (*match_bytes_fn)(const uint8_t *buf1, const uint8_t *buf2, size_t num);
+
+// Portable kernels, also used for the tails the vector kernels leave.
+static size_t match_bytes_forward_scalar(const uint8_t *buf1, const uint8_t *buf2, size_t num) {
+	size_t i = 0;
+#ifdef BDELTA_COMPARE_WORDS
+	for (; i + 8 <= num; i += 8) {
+		uint64_t w1, w2;
+		memcpy(&w1, buf1 + i, 8);
+		memcpy(&w2, buf2 + i, 8);
+		if (w1 != w2)
+			return i + (__builtin_ctzll(w1 ^ w2) >> 3);
+	}
+#endif
+	while (i < num && buf1[i] == buf2[i]) ++i;
+	return i;
+}
+
+static size_t match_bytes_backward_scalar(const uint8_t *buf1, const uint8_t *buf2, size_t num) {
+	size_t i = num;
+#ifdef BDELTA_COMPARE_WORDS
+	for (; i >= 8; i -= 8) {
+		uint64_t w1, w2;
+		memcpy(&w1, buf1 + i - 8, 8);
+		memcpy(&w2, buf2 + i - 8, 8);
+		if (w1 != w2)
+			return num - i + (__builtin_clzll(w1 ^ w2) >> 3);
+	}
+#endif
+	while (i > 0 && buf1[i - 1] == buf2[i - 1]) --i;
+	return num - i;
+}
+
+#ifdef BDELTA_COMPARE_X86
+static size_t match_bytes_forward_sse2(const uint8_t *buf1, const uint8_t *buf2, size_t num) {
+	size_t i = 0;
+	for (; i + 16 <= num; i += 16) {
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(buf1 + i)),
+		        v2 = _mm_loadu_si128((const __m128i *)(buf2 + i));
+		unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) & 0xffff;
+		if (diff)
+			return i + __builtin_ctz(diff);
+	}
+	return i + match_bytes_forward_scalar(buf1 + i, buf2 + i, num - i);
+}
+
+static size_t match_bytes_backward_sse2(const uint8_t *buf1, const uint8_t *buf2, size_t num) {
+	size_t i = num;
+	for (; i >= 16; i -= 16) {
+		__m128i v1 = _mm_loadu_si128((const __m128i *)(buf1 + i - 16)),
+		        v2 = _mm_loadu_si128((const __m128i *)(buf2 + i - 16));
+		unsigned diff = ~_mm_movemask_epi8(_mm_cmpeq_epi8(v1, v2)) & 0xffff;
+		if (diff)
+			return num - i + (__builtin_clz(diff) - 16);
+	}
+	return num - i + match_bytes_backward_scalar(buf1, buf2, i);
+}
+
+__attribute__((target("avx2")))
+static size_t match_bytes_forward_avx2(const uint8_t *buf1, const uint8_t *buf2, size_t num) {
+	size_t i = 0;
+	for (; i + 32 <= num; i += 32) {
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(buf1 + i)),
+		        v2 = _mm256_loadu_si256((const __m256i *)(buf2 + i));
+		unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, v2));
+		if (diff)
+			return i + __builtin_ctz(diff);
+	}
+	return i + match_bytes_forward_sse2(buf1 + i, buf2 + i, num - i);
+}
+
+__attribute__((target("avx2")))
+static size_t match_bytes_backward_avx2(const uint8_t *buf1, const uint8_t *buf2, size_t num) {
+	size_t i = num;
+	for (; i >= 32; i -= 32) {
+		__m256i v1 = _mm256_loadu_si256((const __m256i *)(buf1 + i - 32)),
+		        v2 = _mm256_loadu_si256((const __m256i *)(buf2 + i - 32));
+		unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, v2));
+		if (diff)
+			return num - i + __builtin_clz(diff);
+	}
+	return num - i + match_bytes_backward_sse2(buf1, buf2, i);
+}
+#endif
+
+#ifdef BDELTA_COMPARE_NEON
+// NEON has no movemask; find the differing 16-byte block, then let the
+// scalar kernel locate the byte within it.
+static size_t match_bytes_forward_neon(const uint8_t *buf1, const uint8_t *buf2, size_t num) {
+	size_t i = 0;
+	for (; i + 16 <= num; i += 16)
+		if (vminvq_u8(vceqq_u8(vld1q_u8(buf1 + i), vld1q_u8(buf2 + i))) != 0xff)
+			break;
+	return i + match_bytes_forward_scalar(buf1 + i, buf2 + i, num - i);
+}
+
+static size_t match_bytes_backward_neon(const uint8_t *buf1, const uint8_t *buf2, size_t num) {
+	size_t i = num;
+	for (; i >= 16; i -= 16)
+		if (vminvq_u8(vceqq_u8(vld1q_u8(buf1 + i - 16), vld1q_u8(buf2 + i - 16))) != 0xff)
+			break;
+	return num - i + match_bytes_backward_scalar(buf1, buf2, i);
+}
+#endif
+
+static match_bytes_fn select_match_bytes(bool forward) {
+#if defined(BDELTA_COMPARE_X86)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return forward ? match_bytes_forward_avx2 : match_bytes_backward_avx2;
+	return forward ? match_bytes_forward_sse2 : match_bytes_backward_sse2;
+#elif defined(BDELTA_COMPARE_NEON)
+	return forward ? match_bytes_forward_neon : match_bytes_backward_neon;
+#else
+	return forward ? match_bytes_forward_scalar : match_bytes_backward_scalar;
+#endif
+}
+
+static const match_bytes_fn match_bytes_forward = select_match_bytes(true);
+static const match_bytes_fn match_bytes_backward = select_match_bytes(false);
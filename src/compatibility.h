@@ -2,6 +2,11 @@
  * License, v. 2.0. If a copy of the MPL was not distributed with this
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
+// Internal to the library and tools; bdelta.h doesn't include it.  It is
+// included by file.h as well as the .cpp files, hence the guard.
+#ifndef BDELTA_COMPATIBILITY_H
+#define BDELTA_COMPATIBILITY_H
+
 // Fix for MSVC++, which doesn't support Variable Length Arrays.
 #ifdef _MSC_VER
 	#include <malloc.h>
@@ -11,7 +16,42 @@
 	typedef unsigned __int16 uint16_t;
 	typedef unsigned __int32 uint32_t;
 	typedef unsigned __int64 uint64_t;
+	typedef __int64 int64_t;
+	typedef __int32 int32_t;
+
+	#define fseek64 _fseeki64
+	#define ftell64 _ftelli64
+
+	// For patches and files piped through stdin and stdout.
+	#include <io.h>
+	#include <fcntl.h>
+	#define set_binary_mode(f) _setmode(_fileno(f), _O_BINARY)
 #else
 	#include <stdint.h>
 	#define STACK_ALLOC(name, type, num) type name[num]
+
+	// Build with _FILE_OFFSET_BITS=64 so these are 64-bit on 32-bit hosts too.
+	#define fseek64 fseeko
+	#define ftell64 ftello
+	#define set_binary_mode(f) do {} while (0)
+#endif
+
+// Read-only file mapping is used by the tools whenever the platform has it.
+#if defined(__unix__) || defined(__APPLE__)
+	#define BDELTA_HAVE_MMAP 1
 #endif
+
+// Vectored positional writes, and in-kernel file to file copies (glibc 2.27+).
+#if defined(__linux__) || defined(__FreeBSD__)
+	#define BDELTA_HAVE_PWRITEV 1
+#endif
+// Read-ahead hints for files read through stdio.
+#if defined(__linux__) || defined(__FreeBSD__)
+	#define BDELTA_HAVE_FADVISE 1
+	#include <fcntl.h>
+#endif
+#if defined(__linux__) && defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+	#define BDELTA_HAVE_COPY_FILE_RANGE 1
+#endif
+
+#endif // BDELTA_COMPATIBILITY_H
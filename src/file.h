@@ -3,16 +3,23 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "compatibility.h"
+
+#ifdef BDELTA_HAVE_MMAP
+	#include <sys/mman.h>
+#endif
 
 #define MAX_IO_BLOCK_SIZE (1024 * 1024)
 
-void fread_fixed(FILE *f, void * _buf, unsigned num_bytes) {
+void fread_fixed(FILE *f, void * _buf, uint64_t num_bytes) {
 	char * buf = (char *)_buf;
 
 	while (num_bytes != 0)
 	{
-		unsigned block_size = num_bytes;
-		if (block_size > MAX_IO_BLOCK_SIZE) block_size = MAX_IO_BLOCK_SIZE;
+		unsigned block_size = MAX_IO_BLOCK_SIZE;
+		if (num_bytes < block_size) block_size = (unsigned)num_bytes;
 
 		size_t r = fread(buf, 1, block_size, f);
 		if (r != block_size)
@@ -26,13 +33,13 @@ void fread_fixed(FILE *f, void * _buf, unsigned num_bytes) {
 	}
 }
 
-void fwrite_fixed(FILE *f, const void * _buf, unsigned num_bytes) {
+void fwrite_fixed(FILE *f, const void * _buf, uint64_t num_bytes) {
 	const char * buf = (const char *)_buf;
 
 	while (num_bytes != 0)
 	{
-		unsigned block_size = num_bytes;
-		if (block_size > MAX_IO_BLOCK_SIZE) block_size = MAX_IO_BLOCK_SIZE;
+		unsigned block_size = MAX_IO_BLOCK_SIZE;
+		if (num_bytes < block_size) block_size = (unsigned)num_bytes;
 
 		size_t r = fwrite(buf, 1, block_size, f);
 		if (r != block_size)
@@ -58,6 +65,16 @@ unsigned read_dword(FILE *f) {
 	return (read_word(f) << 16) + low;
 }
 
+uint64_t read_qword(FILE *f) {
+	uint64_t low = read_dword(f);
+	return ((uint64_t)read_dword(f) << 32) + low;
+}
+
+// Reads an unsigned patch integer of intsize (4 or 8) bytes.
+uint64_t read_uint(FILE *f, unsigned intsize) {
+	return intsize == 8 ? read_qword(f) : read_dword(f);
+}
+
 void write_word(FILE *f, unsigned number) {
 	unsigned char b = number & 255,
 	              b2 = number >> 8;
@@ -70,17 +87,307 @@ void write_dword(FILE *f, unsigned number) {
 	write_word(f, number >> 16);
 }
 
-bool fileExists(char *fname) {
+void write_qword(FILE *f, uint64_t number) {
+	write_dword(f, (unsigned)(number & 0xffffffff));
+	write_dword(f, (unsigned)(number >> 32));
+}
+
+void write_uint(FILE *f, uint64_t number, unsigned intsize) {
+	if (intsize == 8)
+		write_qword(f, number);
+	else
+		write_dword(f, (unsigned)number);
+}
+
+// Bulk little-endian conversion between integer arrays and patch bytes,
+// for fields of intsize (4 or 8) bytes.
+void encode_uints(unsigned char *dest, const uint64_t *src, size_t num, unsigned intsize) {
+	for (size_t i = 0; i < num; ++i) {
+		uint64_t number = src[i];
+		for (unsigned j = 0; j < intsize; ++j, number >>= 8)
+			*dest++ = (unsigned char)(number & 255);
+	}
+}
+
+void decode_uints(uint64_t *dest, const unsigned char *src, size_t num, unsigned intsize) {
+	if (intsize == 4) {
+		for (size_t i = 0; i < num; ++i, src += 4)
+			dest[i] = (uint32_t)src[0] | ((uint32_t)src[1] << 8) | ((uint32_t)src[2] << 16) | ((uint32_t)src[3] << 24);
+		return;
+	}
+	for (size_t i = 0; i < num; ++i) {
+		uint64_t number = 0;
+		for (unsigned j = intsize; j-- > 0; )
+			number = (number << 8) | src[j];
+		dest[i] = number;
+		src += intsize;
+	}
+}
+
+// LEB128 varints, as used by version 2 patches: 7 bits per byte, least
+// significant first, with the top bit set on all but the last byte.
+// Signed values are zigzag encoded first, so small magnitudes stay short.
+unsigned char *encode_varint(unsigned char *dest, uint64_t number) {
+	while (number >= 0x80) {
+		*dest++ = (unsigned char)(number | 0x80);
+		number >>= 7;
+	}
+	*dest++ = (unsigned char)number;
+	return dest;
+}
+
+// Decodes one varint from p, stopping at end.  Returns false if it runs
+// past end or is longer than a uint64_t.
+bool decode_varint(const unsigned char *&p, const unsigned char *end, uint64_t &number) {
+	number = 0;
+	for (unsigned shift = 0; p != end && shift < 64; shift += 7) {
+		unsigned char b = *p++;
+		number |= (uint64_t)(b & 0x7f) << shift;
+		if (!(b & 0x80)) return true;
+	}
+	return false;
+}
+
+uint64_t zigzag_encode(uint64_t number) {return (number << 1) ^ (uint64_t)((int64_t)number >> 63);}
+uint64_t zigzag_decode(uint64_t number) {return (number >> 1) ^ (0 - (number & 1));}
+
+// Set in the version field of a patch against several references.
+static const unsigned multipleReferences = 0x100;
+
+// Somewhere other than a file for buffered writers to write to, or
+// buffered readers to read from, such as a compressor.
+class ByteSink {
+public:
+	virtual ~ByteSink() {}
+	virtual void write(const void *data, size_t num) = 0;
+};
+class ByteSource {
+public:
+	virtual ~ByteSource() {}
+	// Reads 1 to num bytes, returning how many, or 0 at the end.
+	virtual size_t read(void *buf, size_t num) = 0;
+};
+
+// Buffers writes to f, for output made of many small fields.  A writer
+// given a position writes there, seeking before each flush, so several
+// writers can fill different regions of one file.  Call flush() when done.
+class BufferedWriter {
+public:
+	BufferedWriter(FILE *f, unsigned size = 1 << 20) {init(f, size, false, 0);}
+	BufferedWriter(FILE *f, uint64_t pos, unsigned size) {init(f, size, true, pos);}
+	BufferedWriter(ByteSink *sink, unsigned size = 1 << 20) {
+		init(NULL, size, false, 0);
+		this->sink = sink;
+	}
+	~BufferedWriter() {delete [] buf;}
+
+	void write(const void *data, uint64_t num) {
+		const unsigned char *p = (const unsigned char *)data;
+		while (num) {
+			if (used == size) flush();
+			unsigned n = (unsigned)std::min<uint64_t>(num, size - used);
+			memcpy(buf + used, p, n);
+			used += n;
+			p += n;
+			num -= n;
+		}
+	}
+	void write_uint(uint64_t number, unsigned intsize) {
+		write_uints(&number, 1, intsize);
+	}
+	void write_uints(const uint64_t *numbers, size_t num, unsigned intsize) {
+		while (num) {
+			if (size - used < intsize) flush();
+			size_t n = std::min<size_t>(num, (size - used) / intsize);
+			encode_uints(buf + used, numbers, n, intsize);
+			used += (unsigned)(n * intsize);
+			numbers += n;
+			num -= n;
+		}
+	}
+	// Space for up to num bytes at the end of the buffer, to be filled in
+	// place and committed with commit().  May return less than num.
+	unsigned char *reserve(unsigned &num) {
+		if (used == size) flush();
+		num = std::min(num, size - used);
+		return buf + used;
+	}
+	void commit(unsigned num) {used += num;}
+	// Position the next byte will have, counting from the writer's start.
+	uint64_t tell() const {return pos + used;}
+	void flush() {
+		if (!used) return;
+		if (sink)
+			sink->write(buf, used);
+		else {
+			if (positioned) fseek64(f, pos, SEEK_SET);
+			fwrite_fixed(f, buf, used);
+		}
+		pos += used;
+		used = 0;
+	}
+
+private:
+	FILE *f;
+	ByteSink *sink;
+	unsigned char *buf;
+	unsigned size, used;
+	bool positioned;
+	uint64_t pos;
+
+	void init(FILE *f, unsigned size, bool positioned, uint64_t pos) {
+		this->f = f;
+		sink = NULL;
+		this->size = size;
+		this->positioned = positioned;
+		this->pos = pos;
+		buf = new unsigned char[size];
+		used = 0;
+	}
+	BufferedWriter(const BufferedWriter &);
+	BufferedWriter &operator=(const BufferedWriter &);
+};
+
+// Buffers reads from f.  Once a reader is in use, all further input from f
+// must go through it.  Errors are thrown as by fread_fixed().
+class BufferedReader {
+public:
+	BufferedReader(FILE *f, unsigned size = 1 << 20) {init(f, NULL, size);}
+	BufferedReader(ByteSource *source, unsigned size = 1 << 20) {init(NULL, source, size);}
+	~BufferedReader() {delete [] buf;}
+
+	void read(void *dest, uint64_t num) {
+		unsigned char *p = (unsigned char *)dest;
+		while (num) {
+			unsigned n;
+			const unsigned char *src = next(num, n);
+			memcpy(p, src, n);
+			p += n;
+			num -= n;
+		}
+	}
+	// Returns a pointer to the next 1 to num buffered bytes, setting n to how
+	// many, and consumes them.
+	const unsigned char *next(uint64_t num, unsigned &n) {
+		if (start == end) fill(1);
+		n = (unsigned)std::min<uint64_t>(num, end - start);
+		start += n;
+		return buf + start - n;
+	}
+	unsigned read_word() {
+		uint64_t number;
+		read_uints(&number, 1, 2);
+		return (unsigned)number;
+	}
+	uint64_t read_uint(unsigned intsize) {
+		uint64_t number;
+		read_uints(&number, 1, intsize);
+		return number;
+	}
+	uint64_t read_varint() {
+		uint64_t number = 0;
+		for (unsigned shift = 0; shift < 64; shift += 7) {
+			unsigned char b;
+			read(&b, 1);
+			number |= (uint64_t)(b & 0x7f) << shift;
+			if (!(b & 0x80)) return number;
+		}
+		throw "read error: bad varint";
+	}
+	// Position of the next byte to be read, in f, or counting from the start
+	// of source.
+	uint64_t tell() {return (source ? sourceRead : ftell64(f)) - (end - start);}
+	// As next(), for up to num bytes, but returns n == 0 at the end of the
+	// input rather than throwing.
+	const unsigned char *next_available(uint64_t num, unsigned &n) {
+		if (start == end) {
+			start = 0;
+			end = (unsigned)read_source(buf, size);
+			if (!end) {
+				n = 0;
+				return buf;
+			}
+		}
+		return next(num, n);
+	}
+	void read_uints(uint64_t *numbers, size_t num, unsigned intsize) {
+		while (num) {
+			if (end - start < intsize) fill(intsize);
+			size_t n = std::min<size_t>(num, (end - start) / intsize);
+			decode_uints(numbers, buf + start, n, intsize);
+			start += (unsigned)(n * intsize);
+			numbers += n;
+			num -= n;
+		}
+	}
+
+private:
+	FILE *f;
+	ByteSource *source;
+	unsigned char *buf;
+	unsigned size, start, end;
+	uint64_t sourceRead; // Bytes taken from source so far
+
+	void init(FILE *f, ByteSource *source, unsigned size) {
+		this->f = f;
+		this->source = source;
+		this->size = size;
+		buf = new unsigned char[size];
+		start = end = 0;
+		sourceRead = 0;
+	}
+	size_t read_source(unsigned char *dest, size_t num) {
+		if (!source) return fread(dest, 1, num, f);
+		size_t r = source->read(dest, num);
+		sourceRead += r;
+		return r;
+	}
+	// Makes at least need bytes available from buf + start.
+	void fill(unsigned need) {
+		memmove(buf, buf + start, end - start);
+		end -= start;
+		start = 0;
+		while (end < need) {
+			size_t r = read_source(buf + end, size - end);
+			if (r == 0)
+				throw "read error: unexpected end of file";
+			end += (unsigned)r;
+		}
+	}
+	BufferedReader(const BufferedReader &);
+	BufferedReader &operator=(const BufferedReader &);
+};
+
+bool fileExists(const char *fname) {
 	FILE *f = fopen(fname, "rb");
 	bool exists = (f != NULL);
 	if (exists) fclose(f);
 	return exists;
 }
 
-unsigned getLenOfFile(char *fname) {
+uint64_t getLenOfFile(const char *fname) {
 	FILE *f = fopen(fname, "rb");
-	fseek(f, 0, SEEK_END);
-	unsigned len = ftell(f);
+	fseek64(f, 0, SEEK_END);
+	uint64_t len = ftell64(f);
 	fclose(f);
 	return len;
 }
+
+// Maps the first len bytes of f read-only.  Returns NULL if the platform
+// doesn't support mapping or the mapping failed; callers fall back to stdio.
+const void *map_file(FILE *f, uint64_t len) {
+#ifdef BDELTA_HAVE_MMAP
+	static const char empty = 0;
+	if (len == 0) return &empty;
+	if (len != (size_t)len) return NULL;
+	void *p = mmap(NULL, (size_t)len, PROT_READ, MAP_PRIVATE, fileno(f), 0);
+	if (p != MAP_FAILED) return p;
+#endif
+	return NULL;
+}
+
+void unmap_file(const void *p, uint64_t len) {
+#ifdef BDELTA_HAVE_MMAP
+	if (p && len) munmap((void *)p, (size_t)len);
+#endif
+}
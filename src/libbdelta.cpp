@@ -3,91 +3,176 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
 
 #include "compatibility.h"
-
-#if !defined(TOKEN_SIZE) || TOKEN_SIZE == 1
-typedef uint8_t Token;
-#elif TOKEN_SIZE == 2
-typedef uint16_t Token;
-#elif TOKEN_SIZE == 4
-typedef uint32_t Token;
-#endif
-
 #include <stdio.h>
+#include <string.h>
 #include "bdelta.h"
 #include "checksum.h"
-#include <list>
-#include <limits>
+#include "compare.h"
+#include "checksum_index.h"
+#include <vector>
 #include <algorithm>
-const bool verbose = false;
-struct checksum_entry {
-	Hash::Value cksum; //Rolling checksums
-	unsigned loc;
-	checksum_entry() {}
-	checksum_entry(Hash::Value cksum, unsigned loc)
-		{this->cksum = cksum; this->loc = loc;}
-};
+#include <atomic>
+#include <thread>
+#include <chrono>
 
+#ifdef BDELTA_HAVE_MMAP
+	#include <sys/mman.h>
+#endif
+const bool verbose = false;
 struct Range {
-	unsigned p, num;
+	uint64_t p, num;
 	Range() {}
-	Range(unsigned p, unsigned num) {this->p = p; this->num = num;}
+	Range(uint64_t p, uint64_t num) {this->p = p; this->num = num;}
 };
 
 struct Match {
-	unsigned p1, p2, num;
-	Match(unsigned p1, unsigned p2, unsigned num) 
+	uint64_t p1, p2, num;
+	Match(uint64_t p1, uint64_t p2, uint64_t num) 
 		{this->p1 = p1; this->p2 = p2; this->num = num;}
 };
 
+struct UnusedRange {
+	uint64_t p, num;
+	const Match *ml, *mr;
+	UnusedRange() {}
+	UnusedRange(uint64_t p, uint64_t num, const Match *ml, const Match *mr) {
+		this->p = p; this->num = num; this->ml = ml; this->mr = mr;
+	}
+};
+
+// Scratch space for the bdelta_pass_2 calls of one worker thread.  The
+// instance keeps it between passes, so the buffers grow to the largest
+// pass rather than being allocated for each pass and hole.
+struct Workspace {
+	std::vector<uint64_t> firstBlock, hashes;
+	std::vector<uint8_t> tags;
+	std::vector<uint64_t> slots; // ChecksumIndex slots, in 8-byte units
+	std::vector<uint64_t> filterWords;
+
+	// What this worker's tables took in the current pass
+	uint64_t peakBytes, blocksIndexed, blocksSkipped;
+	bool sampled;
+	void clearStats() {
+		peakBytes = blocksIndexed = blocksSkipped = 0;
+		sampled = false;
+	}
+};
+
+// What the pass in progress has done so far, added to by every worker.
+struct PassCounters {
+	std::atomic<uint64_t> checksums, dropped, probes, hits, falseHits, comparedTokens, reads, readBytes;
+	std::atomic<uint64_t> buildNanos, scanNanos;
+
+	static void add(std::atomic<uint64_t> &counter, uint64_t n) {counter.fetch_add(n, std::memory_order_relaxed);}
+	void clear() {
+		checksums = dropped = probes = hits = falseHits = comparedTokens = reads = readBytes = 0;
+		buildNanos = scanNanos = 0;
+	}
+	void addReads();
+};
+
+// The read callback calls of this thread not yet added to PassCounters.
+// Reads are too frequent for a shared atomic each, so every worker counts
+// its own and adds them when its task is done.
+struct ReadCounts {
+	uint64_t reads, bytes;
+};
+static thread_local ReadCounts pendingReads;
+
+void PassCounters::addReads() {
+	add(reads, pendingReads.reads);
+	add(readBytes, pendingReads.bytes);
+	pendingReads.reads = pendingReads.bytes = 0;
+}
+
+static uint64_t nanos_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
 struct _BDelta_Instance {
 	bdelta_readCallback cb;
+	bdelta_readCallback64 cb64;
 	void *handle1, *handle2;
-	unsigned data1_size, data2_size;
-	std::list<Match> matches;
-	std::list<Match>::iterator accessplace;
-	int access_int;
+	const void *mem1, *mem2; // Set when both inputs are resident (bdelta_init_mem)
+	unsigned tokenSize;
+	uint64_t data1_size, data2_size; // In tokens
+	std::vector<Match> matches; // Sorted by compareMatchP2
+	const BDelta_Signature *signature; // Of the first input, if given
+	std::vector<uint64_t> refEnds; // Where each reference in the first input ends, if several
+	uint64_t memoryLimit; // For each pass's checksum table; 0 if none
+	bdelta_prefetchCallback prefetch; // Optional read-ahead hint
+	unsigned prefetchAhead; // How far ahead to hint, in tokens
+	BDelta_Stats stats;
+	PassCounters counters;
+	std::vector<BDelta_PassStats> passStats; // One per pass run
 	int errorcode;
 
-	const Token *read1(void *buf, unsigned place, unsigned num)
-		{return (const Token*)cb(handle1, buf, place, num);}
-	const Token *read2(void *buf, unsigned place, unsigned num)
-		{return (const Token*)cb(handle2, buf, place, num);}
+	// Buffers reused by every pass
+	std::vector<Workspace> workspaces; // One per worker thread
+	std::vector<Match> bounded, newMatches, merged;
+	std::vector<UnusedRange> unused, unused2;
+	std::vector<unsigned> holes;
+	std::vector<std::vector<Match> > found;
+
+	template <class Token>
+	const Token *read(void *handle, Token *buf, uint64_t place, unsigned num) {
+		++pendingReads.reads;
+		pendingReads.bytes += (uint64_t)num * sizeof(Token);
+		if (cb64) return (const Token*)cb64(handle, buf, place, num);
+		return (const Token*)cb(handle, buf, (unsigned)place, num);
+	}
+	template <class Token>
+	const Token *read1(Token *buf, uint64_t place, unsigned num)
+		{return mem1 ? (const Token *)mem1 + place : read(handle1, buf, place, num);}
+	template <class Token>
+	const Token *read2(Token *buf, uint64_t place, unsigned num)
+		{return mem2 ? (const Token *)mem2 + place : read(handle2, buf, place, num);}
 };
 
-struct Checksums_Instance {
-	unsigned blocksize;
-	unsigned htablesize;
-	checksum_entry **htable; // Points to first match in checksums
-	checksum_entry *checksums;  // Sorted list of all checksums
-	unsigned numchecksums;
+// Hints the reads of a sequential scan of one input, from start to end, to
+// the prefetch callback, keeping between half and all of prefetchAhead
+// tokens hinted past the scan's position.  An input in memory, mem, isn't
+// hinted.
+struct Prefetcher {
+	BDelta_Instance *b;
+	void *handle;
+	bool active;
+	uint64_t next, end; // next is just past the data hinted so far
 
-	Checksums_Instance(int blocksize) {this->blocksize = blocksize;}
-	void add(checksum_entry ck) {
-		checksums[numchecksums] = ck;
-		++numchecksums;
-	}
-	unsigned tableIndex(Hash::Value hashValue) {
-		return Hash::modulo(hashValue, htablesize);
+	Prefetcher(BDelta_Instance *b, void *handle, const void *mem, uint64_t start, uint64_t end)
+		: b(b), handle(handle), active(b->prefetch && !mem && (b->cb || b->cb64)), next(start), end(end) {}
+	void at(uint64_t place) {
+		if (!active) return;
+		const unsigned ahead = b->prefetchAhead;
+		if (next < place) next = place;
+		if (next >= end || next - place > ahead / 2) return;
+		unsigned num = (unsigned)std::min<uint64_t>(end - next, ahead - (next - place));
+		b->prefetch(handle, next, num);
+		next += num;
 	}
 };
 
-
-unsigned match_buf_forward(const void *buf1, const void *buf2, unsigned num) { 
-	unsigned i = 0;
-	while (i < num && ((const Token*)buf1)[i]==((const Token*)buf2)[i]) ++i;
-	return i;
+// Number of equal tokens at the start of the buffers.  The tokens must be
+// compared whole, so a partly equal token doesn't count.
+template <class Token>
+unsigned match_buf_forward(const Token *buf1, const void *buf2, unsigned num) { 
+	return (unsigned)(match_bytes_forward((const uint8_t *)buf1, (const uint8_t *)buf2, num * sizeof(Token)) / sizeof(Token));
 }
-unsigned match_buf_backward(const void *buf1, const void *buf2, unsigned num) { 
-	int i = num;
-	do --i;
-	while (i >= 0 && ((const Token*)buf1)[i] == ((const Token*)buf2)[i]);
-	return num - i - 1;
+// Number of equal tokens at the end of the buffers.
+template <class Token>
+unsigned match_buf_backward(const Token *buf1, const void *buf2, unsigned num) { 
+	return (unsigned)(match_bytes_backward((const uint8_t *)buf1, (const uint8_t *)buf2, num * sizeof(Token)) / sizeof(Token));
 }
-unsigned match_forward(BDelta_Instance *b, unsigned p1, unsigned p2) { 
-	unsigned num = 0, match, numtoread;
+template <class Token>
+uint64_t match_forward(BDelta_Instance *b, uint64_t p1, uint64_t p2) { 
+	if (b->mem1) {
+		uint64_t numtocompare = std::min(b->data1_size - p1, b->data2_size - p2);
+		return match_bytes_forward((const uint8_t *)((const Token *)b->mem1 + p1), (const uint8_t *)((const Token *)b->mem2 + p2), numtocompare * sizeof(Token)) / sizeof(Token);
+	}
+	uint64_t num = 0;
+	unsigned match, numtoread;
 	do {
-		numtoread = std::min(b->data1_size - p1, b->data2_size - p2);
-		if (numtoread > 4096) numtoread = 4096;
+		numtoread = (unsigned)std::min<uint64_t>(std::min(b->data1_size - p1, b->data2_size - p2), 4096);
 		Token buf1[4096], buf2[4096];
 		const Token *read1 = b->read1(buf1, p1, numtoread),
 		            *read2 = b->read2(buf2, p2, numtoread);
@@ -98,12 +183,16 @@ unsigned match_forward(BDelta_Instance *b, unsigned p1, unsigned p2) {
 	return num;
 }
 
-unsigned match_backward(BDelta_Instance *b, unsigned p1, unsigned p2, unsigned blocksize) {
-	unsigned num = 0, match, numtoread;
+template <class Token>
+uint64_t match_backward(BDelta_Instance *b, uint64_t p1, uint64_t p2, unsigned blocksize) {
+	if (b->mem1) {
+		uint64_t numtocompare = std::min(p1, p2);
+		return match_bytes_backward((const uint8_t *)((const Token *)b->mem1 + p1 - numtocompare), (const uint8_t *)((const Token *)b->mem2 + p2 - numtocompare), numtocompare * sizeof(Token)) / sizeof(Token);
+	}
+	uint64_t num = 0;
+	unsigned match, numtoread;
 	do {
-		numtoread = std::min(p1, p2);
-		if (numtoread > blocksize) numtoread = blocksize;
-		if (numtoread > 4096) numtoread = 4096;
+		numtoread = (unsigned)std::min<uint64_t>(std::min(p1, p2), std::min(blocksize, 4096u));
 		p1 -= numtoread; p2 -= numtoread;
 		Token buf1[4096], buf2[4096];
 		const Token *read1 = b->read1(buf1, p1, numtoread),
@@ -114,16 +203,31 @@ unsigned match_backward(BDelta_Instance *b, unsigned p1, unsigned p2, unsigned b
 	return num;
 }
 
-// Iterator helper function
-template <class T>
-static inline T bdelta_next(T i) {return ++i;}
+// Checksum indexes of a whole first input for a set of blocksizes, built
+// once and used by any number of instances.  Each index is a
+// ChecksumIndex<uint32_t>, or a ChecksumIndex<uint64_t> for inputs of
+// 0xffffffff tokens or more, as bdelta_pass_2 expects.
+struct _BDelta_Signature {
+	unsigned tokenSize, hashFlags;
+	uint64_t size;
+	std::vector<unsigned> blocksizes;
+	std::vector<void *> indexes;
+	void *mapping; // The loaded file the indexes point into, if any
+	uint64_t mappingSize;
 
-struct UnusedRange {
-	unsigned p, num;
-	std::list<Match>::iterator ml, mr;
-	UnusedRange() {}
-	UnusedRange(unsigned p, unsigned num, std::list<Match>::iterator ml, std::list<Match>::iterator mr) {
-		this->p = p; this->num = num; this->ml = ml; this->mr = mr;
+	_BDelta_Signature(unsigned tokenSize, unsigned hashFlags, uint64_t size) {
+		this->tokenSize = tokenSize;
+		this->hashFlags = hashFlags;
+		this->size = size;
+		mapping = 0;
+		mappingSize = 0;
+	}
+	~_BDelta_Signature();
+	bool wide() const {return size >= 0xffffffff;}
+	const void *find(unsigned blocksize) const {
+		for (size_t i = 0; i < blocksizes.size(); ++i)
+			if (blocksizes[i] == blocksize) return indexes[i];
+		return 0;
 	}
 };
 
@@ -144,13 +248,33 @@ bool compareMatchP2(Match r1, Match r2) {
 	return r1.num > r2.num;
 }
 
-void addMatch(BDelta_Instance *b, unsigned p1, unsigned p2, unsigned num, std::list<Match>::iterator place) {
-	Match newMatch = Match(p1, p2, num);
-	while (place != b->matches.begin() && ! compareMatchP2(*place, newMatch))
-		--place;
-	while (place != b->matches.end() && compareMatchP2(*place, newMatch))
-		++place;
-	b->matches.insert(place, newMatch);
+// Splits the matches that run from one reference into the next, adding
+// the later pieces at the end.
+static void split_at_references(const BDelta_Instance *b, std::vector<Match> &found) {
+	const std::vector<uint64_t> &ends = b->refEnds;
+	if (ends.empty()) return;
+	for (size_t i = 0; i < found.size(); ++i) { // Including the pieces, which may cross more
+		Match m = found[i];
+		uint64_t end = *std::upper_bound(ends.begin(), ends.end(), m.p1);
+		if (m.p1 + m.num > end) {
+			found[i].num = end - m.p1;
+			found.push_back(Match(end, m.p2 + (end - m.p1), m.p1 + m.num - end));
+		}
+	}
+}
+
+// Adds the matches found in a pass, in the order they were found.  A new
+// match goes before any existing one that compares equal, and before any
+// equal match found earlier in the pass, as individual sorted inserts would.
+void addMatches(BDelta_Instance *b, std::vector<Match> &found) {
+	if (found.empty()) return;
+	split_at_references(b, found);
+	std::reverse(found.begin(), found.end());
+	std::stable_sort(found.begin(), found.end(), compareMatchP2);
+	std::vector<Match> &merged = b->merged;
+	merged.resize(b->matches.size() + found.size(), Match(0, 0, 0));
+	std::merge(found.begin(), found.end(), b->matches.begin(), b->matches.end(), merged.begin(), compareMatchP2);
+	b->matches.swap(merged);
 }
 
 template<class T>
@@ -158,56 +282,100 @@ T absoluteDifference(T a, T b) {
 	return std::max(a, b) - std::min(a, b);
 }
 
-void findMatches(BDelta_Instance *b, Checksums_Instance *h, unsigned minMatchSize, unsigned start, unsigned end, unsigned place, std::list<Match>::iterator iterPlace) {
-	const unsigned blocksize = h->blocksize;
+// Runs task(i, worker) for every i in [0, num) on up to numThreads threads,
+// which take the indices in order from a shared counter.  worker numbers
+// the thread, from 0.  With one thread the tasks run on the calling thread.
+template <class Task>
+void run_tasks(Task &task, uint64_t num, unsigned numThreads) {
+	if (numThreads > num) numThreads = (unsigned)num;
+	if (numThreads <= 1) {
+		for (uint64_t i = 0; i < num; ++i) task(i, 0);
+		return;
+	}
+	std::atomic<uint64_t> next(0);
+	std::vector<std::thread> threads;
+	for (unsigned t = 0; t < numThreads; ++t)
+		threads.push_back(std::thread([&task, &next, num, t]() {
+			for (uint64_t i; (i = next++) < num; )
+				task(i, t);
+		}));
+	for (unsigned t = 0; t < numThreads; ++t)
+		threads[t].join();
+}
+
+// Whether the block at loc lies wholly within one of the ranges, which are
+// in order of position and don't overlap.
+bool in_ranges(const UnusedRange *ranges, unsigned numranges, uint64_t loc, unsigned blocksize) {
+	unsigned lo = 0, hi = numranges;
+	while (lo < hi) {
+		unsigned mid = lo + (hi - lo) / 2;
+		if (ranges[mid].p <= loc) lo = mid + 1;
+		else hi = mid;
+	}
+	return lo && loc + blocksize <= ranges[lo - 1].p + ranges[lo - 1].num;
+}
+
+// If allowed is set, only blocks of the first input within those ranges
+// are candidates.
+template <class Hash, class Index>
+void findMatches(BDelta_Instance *b, const typename Hash::Window &w, const Index *h, unsigned minMatchSize, uint64_t start, uint64_t end, uint64_t place, std::vector<Match> &found, const UnusedRange *allowed, unsigned numallowed) {
+	typedef typename Hash::Token Token;
+	const unsigned blocksize = Hash::fixedBlocksize ? Hash::fixedBlocksize : h->blocksize;
 	STACK_ALLOC(buf1, Token, blocksize);
 	STACK_ALLOC(buf2, Token, blocksize);
 
-	unsigned best1, best2, bestnum = 0;
-	unsigned processMatchesPos;
+	uint64_t best1, best2, bestnum = 0;
+	uint64_t processMatchesPos;
+	Prefetcher prefetcher(b, b->handle2, b->mem2, start, end);
+	prefetcher.at(start);
 	const Token *inbuf = b->read2(buf1, start, blocksize),
 	            *outbuf;
-	Hash hash = Hash(inbuf, blocksize);
+	Hash hash = Hash(w, inbuf);
 	unsigned buf_loc = blocksize;
-	for (unsigned j = start + blocksize; ; ++j) {
-		unsigned thisTableIndex = h->tableIndex(hash.getValue());
-		checksum_entry *c = h->htable[thisTableIndex];
+	// Counted here and added to the instance's counters once, at the end
+	uint64_t probes = 0, hits = 0, falseHits = 0, compared = 0;
+	for (uint64_t j = start + blocksize; ; ++j) {
+		const typename Index::Slot *c = h->find(hash.getValue());
+		++probes;
 		if (c) {
-			do {
-				if (c->cksum == hash.getValue()) {
-					unsigned p1 = c->loc, p2 = j - blocksize;
-					unsigned fnum = match_forward(b, p1, p2);
-					if (fnum >= blocksize) {
-						unsigned bnum = match_backward(b, p1, p2, blocksize);
-						unsigned num = fnum + bnum;
-						if (num >= minMatchSize) {
-							p1 -= bnum; p2 -= bnum;
-							bool foundBetter;
-							if (bestnum) {
-								double oldValue = double(bestnum) / (absoluteDifference(place, best1) + blocksize * 2),
-									   newValue = double(num) / (absoluteDifference(place, p1) + blocksize * 2);
-								foundBetter = newValue > oldValue;
-							} else {
-								foundBetter = true;
-								processMatchesPos = std::min(j + blocksize - 1, end);
-							}
-							if (foundBetter) {
-								best1 = p1;
-								best2 = p2;
-								bestnum = num;
-							}
-
+			for (unsigned k = 0; k < Index::maxLocs && c->loc[k] != Index::noLoc; ++k) {
+				uint64_t p1 = c->loc[k], p2 = j - blocksize;
+				if (allowed && !in_ranges(allowed, numallowed, p1, blocksize))
+					continue;
+				++hits;
+				uint64_t fnum = match_forward<Token>(b, p1, p2);
+				compared += fnum;
+				if (fnum < blocksize) ++falseHits;
+				if (fnum >= blocksize) {
+					uint64_t bnum = match_backward<Token>(b, p1, p2, blocksize);
+					compared += bnum;
+					uint64_t num = fnum + bnum;
+					if (num >= minMatchSize) {
+						p1 -= bnum; p2 -= bnum;
+						bool foundBetter;
+						if (bestnum) {
+							double oldValue = double(bestnum) / (absoluteDifference(place, best1) + blocksize * 2),
+								   newValue = double(num) / (absoluteDifference(place, p1) + blocksize * 2);
+							foundBetter = newValue > oldValue;
+						} else {
+							foundBetter = true;
+							processMatchesPos = std::min<uint64_t>(j + blocksize - 1, end);
 						}
+						if (foundBetter) {
+							best1 = p1;
+							best2 = p2;
+							bestnum = num;
+						}
+
 					}
 				}
-				++c;
-			} while (h->tableIndex(c->cksum) == thisTableIndex);
+			}
 		}
 
 		if (bestnum && j >= processMatchesPos) {
-			addMatch(b, best1, best2, bestnum, iterPlace);
+			found.push_back(Match(best1, best2, bestnum));
 			place = best1 + bestnum;
-			unsigned matchEnd = best2 + bestnum;
+			uint64_t matchEnd = best2 + bestnum;
 			if (matchEnd > j) {
 				if (matchEnd >= end)
 					j = end;
@@ -215,7 +383,7 @@ void findMatches(BDelta_Instance *b, Checksums_Instance *h, unsigned minMatchSiz
 					// Fast forward over matched area.
 					j = matchEnd - blocksize;
 					inbuf = b->read2(buf1, j, blocksize);
-					hash = Hash(inbuf, blocksize);
+					hash = Hash(w, inbuf);
 					buf_loc = blocksize;
 					j += blocksize;
 				}
@@ -226,7 +394,8 @@ void findMatches(BDelta_Instance *b, Checksums_Instance *h, unsigned minMatchSiz
 		if (buf_loc == blocksize) {
 			buf_loc = 0;
 			std::swap(inbuf, outbuf);
-			inbuf = b->read2(outbuf == buf1 ? buf2 : buf1, j, std::min(end - j, blocksize));
+			prefetcher.at(j);
+			inbuf = b->read2(outbuf == buf1 ? buf2 : buf1, j, (unsigned)std::min<uint64_t>(end - j, blocksize));
 		}
 
 		if (j >= end)
@@ -235,28 +404,19 @@ void findMatches(BDelta_Instance *b, Checksums_Instance *h, unsigned minMatchSiz
 		hash.advance(outbuf[buf_loc], inbuf[buf_loc]);
 		++buf_loc;
 	}
+	PassCounters &counters = b->counters;
+	PassCounters::add(counters.probes, probes);
+	PassCounters::add(counters.hits, hits);
+	PassCounters::add(counters.falseHits, falseHits);
+	PassCounters::add(counters.comparedTokens, compared);
+	counters.addReads();
 }
 
-struct Checksums_Compare {
-	Checksums_Instance &ci;
-	Checksums_Compare(Checksums_Instance &h) : ci(h) {}
-	bool operator() (checksum_entry c1, checksum_entry c2) {
-		unsigned ti1 = ci.tableIndex(c1.cksum), ti2 = ci.tableIndex(c2.cksum);
-		if (ti1 == ti2)
-			if (c1.cksum == c2.cksum)
-				return c1.loc < c2.loc;
-			else
-				return c1.cksum < c2.cksum;
-		else
-			return ti1 < ti2;
-	}
-};
-
-BDelta_Instance *bdelta_init_alg(unsigned data1_size, unsigned data2_size,
-		bdelta_readCallback cb, void *handle1, void *handle2,
+static BDelta_Instance *bdelta_init(uint64_t data1_size, uint64_t data2_size,
+		bdelta_readCallback cb, bdelta_readCallback64 cb64, void *handle1, void *handle2,
 		unsigned tokenSize) {
-	if (tokenSize != sizeof(Token)) {
-		printf("Error: BDelta library compiled for token size of %lu.\n", (unsigned long)sizeof (Token));
+	if (tokenSize != 1 && tokenSize != 2 && tokenSize != 4) {
+		printf("Error: BDelta doesn't support a token size of %u.\n", tokenSize);
 		return 0;
 	}
 	BDelta_Instance *b = new BDelta_Instance;
@@ -264,143 +424,431 @@ BDelta_Instance *bdelta_init_alg(unsigned data1_size, unsigned data2_size,
 	b->data1_size = data1_size;
 	b->data2_size = data2_size;
 	b->cb = cb;
+	b->cb64 = cb64;
 	b->handle1 = handle1;
 	b->handle2 = handle2;
-	b->access_int = -1;
+	b->mem1 = b->mem2 = 0;
+	b->tokenSize = tokenSize;
+	b->signature = 0;
+	b->memoryLimit = 0;
+	b->prefetch = 0;
+	b->prefetchAhead = 0;
+	memset(&b->stats, 0, sizeof(b->stats));
+	b->counters.clear();
+	b->errorcode = BDELTA_OK;
 	return b;
 }
 
+BDelta_Instance *bdelta_init_alg(unsigned data1_size, unsigned data2_size,
+		bdelta_readCallback cb, void *handle1, void *handle2,
+		unsigned tokenSize) {
+	return bdelta_init(data1_size, data2_size, cb, 0, handle1, handle2, tokenSize);
+}
+
+BDelta_Instance *bdelta_init_alg64(uint64_t data1_size, uint64_t data2_size,
+		bdelta_readCallback64 cb, void *handle1, void *handle2,
+		unsigned tokenSize) {
+	return bdelta_init(data1_size, data2_size, 0, cb, handle1, handle2, tokenSize);
+}
+
+BDelta_Instance *bdelta_init_mem(const void *data1, uint64_t data1_size,
+		const void *data2, uint64_t data2_size,
+		unsigned tokenSize) {
+	BDelta_Instance *b = bdelta_init(data1_size, data2_size, 0, 0, 0, 0, tokenSize);
+	if (!b) return 0;
+	b->mem1 = data1;
+	b->mem2 = data2;
+	return b;
+}
+
+void bdelta_reset(BDelta_Instance *b, uint64_t data1_size, uint64_t data2_size,
+		void *handle1, void *handle2) {
+	if (b->cb || b->cb64) {
+		b->handle1 = handle1;
+		b->handle2 = handle2;
+	} else {
+		b->mem1 = handle1;
+		b->mem2 = handle2;
+	}
+	b->data1_size = data1_size;
+	b->data2_size = data2_size;
+	b->matches.clear();
+	b->signature = 0;
+	b->refEnds.clear();
+	memset(&b->stats, 0, sizeof(b->stats));
+	b->passStats.clear();
+	b->errorcode = BDELTA_OK;
+}
+
+int bdelta_set_references(BDelta_Instance *b, const uint64_t *refSizes, unsigned numRefs) {
+	uint64_t total = 0;
+	for (unsigned i = 0; i < numRefs; ++i) total += refSizes[i];
+	if (numRefs && total != b->data1_size)
+		return BDELTA_REFERENCE_MISMATCH;
+	b->refEnds.clear();
+	if (numRefs < 2) return BDELTA_OK;
+	// The last reference ends at data1_size, past every match start.
+	uint64_t end = 0;
+	for (unsigned i = 0; i < numRefs; ++i)
+		b->refEnds.push_back(end += refSizes[i]);
+	std::vector<Match> &m = b->matches;
+	size_t num = m.size();
+	split_at_references(b, m);
+	if (m.size() != num) std::stable_sort(m.begin(), m.end(), compareMatchP2);
+	return BDELTA_OK;
+}
+
+void bdelta_set_memory_limit(BDelta_Instance *b, uint64_t bytes) {
+	b->memoryLimit = bytes;
+}
+
+void bdelta_set_prefetch(BDelta_Instance *b, bdelta_prefetchCallback prefetch, unsigned ahead) {
+	b->prefetch = b->cb || b->cb64 ? prefetch : 0;
+	b->prefetchAhead = ahead ? ahead : 1 << 20;
+}
+
+void bdelta_get_stats(BDelta_Instance *b, BDelta_Stats *stats) {
+	*stats = b->stats;
+}
+
+void bdelta_get_pass_stats(BDelta_Instance *b, unsigned passNum, BDelta_PassStats *stats) {
+	if (passNum < b->passStats.size())
+		*stats = b->passStats[passNum];
+	else
+		memset(stats, 0, sizeof(*stats));
+}
+
 void bdelta_done_alg(BDelta_Instance *b) {
 	b->matches.clear();
 	delete b;
 }
 
 
-// Adapted from http://graphics.stanford.edu/~seander/bithacks.html#RoundUpPowerOf2
-unsigned roundUpPowerOf2(unsigned v) {
-	--v;
-	for (int i = 1; i <= 16; i *= 2)
-		v |= v >> i;
-	return v + 1;
-}
+// Computes the checksums for one slice of the blocks in the unused ranges.
+template <class Hash>
+struct ChecksumTask {
+	BDelta_Instance *b;
+	const typename Hash::Window &w;
+	const UnusedRange *unused;
+	const std::vector<uint64_t> &firstBlock; // Index of the first block of each range
+	uint64_t *hashes; // hashes[0] is for block start
+	uint64_t start, end;
+	static const uint64_t sliceBlocks = 1 << 16;
 
-void bdelta_pass_2(BDelta_Instance *b, unsigned blocksize, unsigned minMatchSize, UnusedRange *unused, unsigned numunused, UnusedRange *unused2, unsigned numunused2) {
-	Checksums_Instance h(blocksize);
-	b->access_int = -1;
+	ChecksumTask(BDelta_Instance *b, const typename Hash::Window &w, const UnusedRange *unused, const std::vector<uint64_t> &firstBlock, uint64_t *hashes, uint64_t start, uint64_t end)
+		: b(b), w(w), unused(unused), firstBlock(firstBlock), hashes(hashes), start(start), end(end) {}
+	void operator() (uint64_t slice, unsigned) {
+		typedef typename Hash::Token Token;
+		const unsigned blocksize = Hash::fixedBlocksize ? Hash::fixedBlocksize : w.blocksize;
+		STACK_ALLOC(buf, Token, blocksize);
+		uint64_t block = start + slice * sliceBlocks,
+		         lastBlock = std::min(block + sliceBlocks, end);
+		size_t r = std::upper_bound(firstBlock.begin(), firstBlock.end(), block) - firstBlock.begin() - 1;
+		// Each range's blocks in the slice are read in order
+		Prefetcher prefetcher(b, b->handle1, b->mem1, 0, 0);
+		for (; block < lastBlock; ++block) {
+			while (block >= firstBlock[r + 1]) ++r;
+			uint64_t loc = unused[r].p + (block - firstBlock[r]) * blocksize;
+			if (loc >= prefetcher.end)
+				prefetcher = Prefetcher(b, b->handle1, b->mem1, loc, unused[r].p + (std::min(firstBlock[r + 1], lastBlock) - firstBlock[r]) * blocksize);
+			prefetcher.at(loc);
+			const Token *read = b->read1(buf, loc, blocksize);
+			hashes[block - start] = Hash(w, read).getValue();
+		}
+		PassCounters::add(b->counters.checksums, lastBlock - (start + slice * sliceBlocks));
+		b->counters.addReads();
+	}
+};
 
-	unsigned numblocks = 0;
+// Numbers the whole blocks of the unused ranges; firstBlock[i] is the
+// first of range i.  Returns the number of blocks.
+uint64_t count_blocks(const UnusedRange *unused, unsigned numunused, unsigned blocksize, std::vector<uint64_t> &firstBlock) {
+	firstBlock.resize(numunused + 1);
+	firstBlock[0] = 0;
 	for (unsigned i = 0; i < numunused; ++i) {
-		numblocks += unused[i].num / blocksize;
+		firstBlock[i + 1] = firstBlock[i] + unused[i].num / blocksize;
 	}
+	return firstBlock[numunused];
+}
 
-	// numblocks = size / blocksize;
-	h.htablesize = std::max((unsigned)2, roundUpPowerOf2(numblocks));
-	h.htable = new checksum_entry*[h.htablesize];
-	if (!h.htable) {b->errorcode = BDELTA_MEM_ERROR; return;}
-	h.checksums = new checksum_entry[numblocks + 2];
-	if (!h.checksums) {b->errorcode = BDELTA_MEM_ERROR; return;}
+// Whether a block with checksum cksum is indexed when only one in
+// 2^sampleShift are.  The choice depends only on the block's content, so
+// a block of the second input matching an indexed block is always found.
+static inline bool sample_block(uint64_t cksum, unsigned sampleShift) {
+	return !sampleShift || (cksum * 0xD6E8FEB86659FD93ull) >> (64 - sampleShift) == 0;
+}
 
-	h.numchecksums = 0;
-	// unsigned numchecksums = 0;
-	STACK_ALLOC(buf, Token, blocksize);
-	for (unsigned i = 0; i < numunused; ++i) {
-		unsigned first = unused[i].p, last = unused[i].p + unused[i].num;
-		for (unsigned loc = first; loc + blocksize <= last; loc += blocksize) {
-			const Token *read = b->read1(buf, loc, blocksize);
-			Hash::Value blocksum = Hash(read, blocksize).getValue();
-			// Adjacent checksums are never repeated.
-			//if (! h.numchecksums || blocksum != h.checksums[h.numchecksums - 1].cksum)
-				h.add(checksum_entry(blocksum, loc));
+// Adds the blocks of the unused ranges to h, or those chosen by
+// sample_block().  Checksums are computed batchBlocks at a time, or all at
+// once if batchBlocks is 0.  Returns the number of blocks added.
+template <class Hash, class Loc>
+uint64_t fill_index(BDelta_Instance *b, const typename Hash::Window &w, ChecksumIndex<Loc> &h, const UnusedRange *unused, unsigned numunused, const std::vector<uint64_t> &firstBlock, std::vector<uint64_t> &hashes, unsigned sampleShift, uint64_t batchBlocks, unsigned numThreads) {
+	const unsigned blocksize = w.blocksize;
+	const uint64_t sliceBlocks = ChecksumTask<Hash>::sliceBlocks;
+	uint64_t numblocks = firstBlock[numunused];
+	if (!batchBlocks || batchBlocks > numblocks) batchBlocks = numblocks;
+
+	// Checksums are computed in parallel, but added in order of location
+	// so that each one lists its locations in increasing order.
+	hashes.resize(batchBlocks);
+	uint64_t block = 0, added = 0, dropped = 0;
+	unsigned r = 0;
+	for (uint64_t start = 0; start < numblocks; start += batchBlocks) {
+		uint64_t end = std::min(start + batchBlocks, numblocks);
+		ChecksumTask<Hash> checksumTask(b, w, unused, firstBlock, &hashes[0], start, end);
+		run_tasks(checksumTask, (end - start + sliceBlocks - 1) / sliceBlocks, numThreads);
+
+		for (; block < end; ++block) {
+			while (block >= firstBlock[r + 1]) ++r;
+			uint64_t cksum = hashes[block - start];
+			if (sample_block(cksum, sampleShift)) {
+				dropped += h.add(cksum, (Loc)(unused[r].p + (block - firstBlock[r]) * blocksize));
+				++added;
+			}
 		}
 	}
+	PassCounters::add(b->counters.dropped, dropped);
+	return added;
+}
 
-	if (h.numchecksums) {
-		std::sort(h.checksums, h.checksums + h.numchecksums, Checksums_Compare(h));
-		const unsigned maxIdenticalChecksums = 2;
-		unsigned writeLoc = 0, readLoc, testAhead;
-		for (readLoc = 0; readLoc < h.numchecksums; readLoc = testAhead) {
-			for (testAhead = readLoc; testAhead < h.numchecksums && h.checksums[readLoc].cksum == h.checksums[testAhead].cksum; ++testAhead)
-				;
-			if (testAhead - readLoc <= maxIdenticalChecksums)
-				for (unsigned i = readLoc; i < testAhead; ++i)
-					h.checksums[writeLoc++] = h.checksums[i];
-		}
-		h.numchecksums = writeLoc;
+// Bytes taken by a ChecksumIndex sized for numentries.
+template <class Loc>
+uint64_t index_bytes(uint64_t numentries) {
+	typedef ChecksumIndex<Loc> Index;
+	uint64_t numbuckets = Index::bucketsFor(numentries),
+	         bytes = numbuckets * Index::bucketSlots * (1 + sizeof(typename Index::Slot));
+	if (Index::wantsFilter(numbuckets))
+		bytes += ChecksumFilter::wordsFor(numentries) * sizeof(uint64_t);
+	return bytes;
+}
+
+template <class Hash, class Index>
+struct FindMatchesTask {
+	BDelta_Instance *b;
+	const typename Hash::Window &w;
+	const Index &h;
+	unsigned minMatchSize;
+	UnusedRange *unused, *unused2;
+	std::vector<Match> *found;
+	const UnusedRange *allowed;
+	unsigned numallowed;
+
+	FindMatchesTask(BDelta_Instance *b, const typename Hash::Window &w, const Index &h, unsigned minMatchSize, UnusedRange *unused, UnusedRange *unused2, std::vector<Match> *found, const UnusedRange *allowed, unsigned numallowed)
+		: b(b), w(w), h(h), minMatchSize(minMatchSize), unused(unused), unused2(unused2), found(found), allowed(allowed), numallowed(numallowed) {}
+	void operator() (uint64_t i, unsigned) {
+		if (unused2[i].num >= h.blocksize)
+			findMatches<Hash>(b, w, &h, minMatchSize, unused2[i].p, unused2[i].p + unused2[i].num, unused[i].p, found[i], allowed, numallowed);
+	}
+};
+
+// Searches unused2[i] for blocks of unused[] and collects the results in
+// found[i], using the rolling hash Hash.  Loc is wide enough for any
+// position in the first input.  If prebuilt is set, it is a signature's
+// index of the whole first input, and its blocks are used instead where
+// they lie within unused[].
+template <class Hash, class Loc>
+void bdelta_pass_2(BDelta_Instance *b, unsigned blocksize, unsigned minMatchSize, UnusedRange *unused, unsigned numunused, UnusedRange *unused2, unsigned numunused2, std::vector<Match> *found, const ChecksumIndex<Loc> *prebuilt, Workspace &ws, unsigned numThreads) {
+	typename Hash::Window w(blocksize);
+	if (prebuilt) {
+		std::chrono::steady_clock::time_point scanStart = std::chrono::steady_clock::now();
+		FindMatchesTask<Hash, ChecksumIndex<Loc> > findTask(b, w, *prebuilt, minMatchSize, unused, unused2, found, unused, numunused);
+		run_tasks(findTask, numunused2, numThreads);
+		PassCounters::add(b->counters.scanNanos, nanos_since(scanStart));
+		return;
+	}
+
+	// The index lives in the workspace's buffers.
+	typedef ChecksumIndex<Loc> Index;
+	uint64_t numblocks = count_blocks(unused, numunused, blocksize, ws.firstBlock),
+	         numentries = numblocks, batchBlocks = 0, bytes = index_bytes<Loc>(numblocks) + numblocks * sizeof(uint64_t);
+	unsigned sampleShift = 0;
+	if (b->memoryLimit && bytes > b->memoryLimit) {
+		// Hash in batches, and index only a sample of the blocks, sized to
+		// fit.  The table has some room over the expected sample size.  The
+		// batch takes up to an eighth of the limit, in whole slices, and
+		// doesn't depend on numThreads, so neither do the matches.
+		const uint64_t sliceBlocks = ChecksumTask<Hash>::sliceBlocks;
+		batchBlocks = std::min(numblocks, std::max<uint64_t>(1, b->memoryLimit / 8 / sizeof(uint64_t) / sliceBlocks) * sliceBlocks);
+		do {
+			++sampleShift;
+			uint64_t expected = numblocks >> sampleShift;
+			numentries = std::min(numblocks, expected + expected / 8 + 64);
+			bytes = index_bytes<Loc>(numentries) + batchBlocks * sizeof(uint64_t);
+		} while (bytes > b->memoryLimit && sampleShift < 32);
+		ws.sampled = true;
+	}
+	ws.peakBytes = std::max(ws.peakBytes, bytes);
+	std::chrono::steady_clock::time_point buildStart = std::chrono::steady_clock::now();
+	uint64_t numbuckets = Index::bucketsFor(numentries), numslots = numbuckets * Index::bucketSlots;
+	ws.tags.assign(numslots, 0);
+	ws.slots.resize((numslots * sizeof(typename Index::Slot) + 7) / 8);
+	ChecksumFilter *filter = 0;
+	if (Index::wantsFilter(numbuckets)) {
+		uint64_t numwords = ChecksumFilter::wordsFor(numentries);
+		ws.filterWords.assign(numwords, 0);
+		filter = new ChecksumFilter(&ws.filterWords[0], numwords);
 	}
-	h.checksums[h.numchecksums].cksum = std::numeric_limits<Hash::Value>::max(); // If there's only one checksum, we might hit this and not know it,
-	h.checksums[h.numchecksums].loc = 0; // So we'll just read from the beginning of the file to prevent crashes.
-	h.checksums[h.numchecksums + 1].cksum = 0;
+	Index h(blocksize, numbuckets, &ws.tags[0], (typename Index::Slot *)&ws.slots[0], filter);
+	uint64_t added = fill_index<Hash>(b, w, h, unused, numunused, ws.firstBlock, ws.hashes, sampleShift, batchBlocks, numThreads);
+	ws.blocksIndexed += added;
+	ws.blocksSkipped += numblocks - added;
+	PassCounters::add(b->counters.buildNanos, nanos_since(buildStart));
 
-	for (unsigned i = 0; i < h.htablesize; ++i) h.htable[i] = 0;
-	for (int i = h.numchecksums - 1; i >= 0; --i)
-		h.htable[h.tableIndex(h.checksums[i].cksum)] = &h.checksums[i];
+	std::chrono::steady_clock::time_point scanStart = std::chrono::steady_clock::now();
+	FindMatchesTask<Hash, ChecksumIndex<Loc> > findTask(b, w, h, minMatchSize, unused, unused2, found, 0, 0);
+	run_tasks(findTask, numunused2, numThreads);
+	PassCounters::add(b->counters.scanNanos, nanos_since(scanStart));
+}
+
+template <class Hash>
+void bdelta_pass_2(BDelta_Instance *b, unsigned blocksize, unsigned minMatchSize, UnusedRange *unused, unsigned numunused, UnusedRange *unused2, unsigned numunused2, std::vector<Match> *found, const void *prebuilt, Workspace &ws, unsigned numThreads) {
+	// Locations that fit leave room for ChecksumIndex::noLoc.
+	if (b->data1_size < 0xffffffff)
+		bdelta_pass_2<Hash, uint32_t>(b, blocksize, minMatchSize, unused, numunused, unused2, numunused2, found, (const ChecksumIndex<uint32_t> *)prebuilt, ws, numThreads);
+	else
+		bdelta_pass_2<Hash, uint64_t>(b, blocksize, minMatchSize, unused, numunused, unused2, numunused2, found, (const ChecksumIndex<uint64_t> *)prebuilt, ws, numThreads);
+}
 
-	for (unsigned i = 0; i < numunused2; ++i)
-		if (unused2[i].num >= blocksize)
-			findMatches(b, &h, minMatchSize, unused2[i].p, unused2[i].p + unused2[i].num, unused[i].p, unused2[i].mr);
+template <class Token>
+void bdelta_pass_2(BDelta_Instance *b, unsigned blocksize, unsigned minMatchSize, UnusedRange *unused, unsigned numunused, UnusedRange *unused2, unsigned numunused2, std::vector<Match> *found, unsigned flags, Workspace &ws, unsigned numThreads) {
+	const BDelta_Signature *sig = b->signature;
+	const void *prebuilt = sig && sig->hashFlags == (flags & BDELTA_HASH_MASK) ? sig->find(blocksize) : 0;
+	switch (flags & BDELTA_HASH_MASK) {
+	case BDELTA_HASH_BUZHASH:
+		bdelta_pass_2<BuzHash<Token> >(b, blocksize, minMatchSize, unused, numunused, unused2, numunused2, found, prebuilt, ws, numThreads);
+		break;
+	case BDELTA_HASH_CRC32C:
+		bdelta_pass_2<Crc32cHash<Token> >(b, blocksize, minMatchSize, unused, numunused, unused2, numunused2, found, prebuilt, ws, numThreads);
+		break;
+	default:
+		// The blocksizes of bdelta's pass schedule have kernels of their own.
+		switch (blocksize) {
+#define FIXED_BLOCKSIZE(n) case n: bdelta_pass_2<BasicPolynomialHash<Token, n> >(b, blocksize, minMatchSize, unused, numunused, unused2, numunused2, found, prebuilt, ws, numThreads); break;
+		FIXED_BLOCKSIZE(997)
+		FIXED_BLOCKSIZE(503)
+		FIXED_BLOCKSIZE(127)
+		FIXED_BLOCKSIZE(31)
+		FIXED_BLOCKSIZE(13)
+		FIXED_BLOCKSIZE(7)
+		FIXED_BLOCKSIZE(5)
+		FIXED_BLOCKSIZE(3)
+#undef FIXED_BLOCKSIZE
+		default:
+			bdelta_pass_2<PolynomialHash<Token> >(b, blocksize, minMatchSize, unused, numunused, unused2, numunused2, found, prebuilt, ws, numThreads);
+		}
+	}
+}
 
-	delete [] h.htable;
-	delete [] h.checksums;
+void bdelta_pass_2(BDelta_Instance *b, unsigned blocksize, unsigned minMatchSize, UnusedRange *unused, unsigned numunused, UnusedRange *unused2, unsigned numunused2, std::vector<Match> *found, unsigned flags, Workspace &ws, unsigned numThreads) {
+	switch (b->tokenSize) {
+	case 1: bdelta_pass_2<uint8_t>(b, blocksize, minMatchSize, unused, numunused, unused2, numunused2, found, flags, ws, numThreads); break;
+	case 2: bdelta_pass_2<uint16_t>(b, blocksize, minMatchSize, unused, numunused, unused2, numunused2, found, flags, ws, numThreads); break;
+	case 4: bdelta_pass_2<uint32_t>(b, blocksize, minMatchSize, unused, numunused, unused2, numunused2, found, flags, ws, numThreads); break;
+	}
 }
 
+// One hole pair of a non-global pass.
+struct HoleTask {
+	BDelta_Instance *b;
+	unsigned blocksize, minMatchSize, flags;
+	UnusedRange *unused, *unused2;
+	const std::vector<unsigned> &holes;
+	std::vector<Match> *found;
+
+	HoleTask(BDelta_Instance *b, unsigned blocksize, unsigned minMatchSize, unsigned flags, UnusedRange *unused, UnusedRange *unused2, const std::vector<unsigned> &holes, std::vector<Match> *found)
+		: b(b), blocksize(blocksize), minMatchSize(minMatchSize), flags(flags), unused(unused), unused2(unused2), holes(holes), found(found) {}
+	void operator() (uint64_t k, unsigned worker) {
+		unsigned i = holes[k];
+		bdelta_pass_2(b, blocksize, minMatchSize, &unused[i], 1, &unused2[i], 1, &found[k], flags, b->workspaces[worker], 1);
+	}
+};
+
 void bdelta_swap_inputs(BDelta_Instance *b) {
-	for (std::list<Match>::iterator l = b->matches.begin(); l != b->matches.end(); ++l)
+	for (std::vector<Match>::iterator l = b->matches.begin(); l != b->matches.end(); ++l)
 		std::swap(l->p1, l->p2);
 	std::swap(b->data1_size, b->data2_size);
 	std::swap(b->handle1, b->handle2);
-	b->matches.sort(compareMatchP2);
+	std::swap(b->mem1, b->mem2);
+	b->signature = 0; // It was of the old first input
+	b->refEnds.clear(); // As were the references
+	std::stable_sort(b->matches.begin(), b->matches.end(), compareMatchP2);
 }
 
 void bdelta_clean_matches(BDelta_Instance *b, unsigned flags) {
-	std::list<Match>::iterator nextL = b->matches.begin();
-	if (nextL == b->matches.end()) return;
-	while (true) {
-		std::list<Match>::iterator l = nextL;
-		if (++nextL == b->matches.end())
-			break;
-
-		int overlap = l->p2 + l->num - nextL->p2;
+	std::vector<Match> &m = b->matches;
+	if (m.empty()) return;
+	size_t l = 0;
+	for (size_t next = 1; next < m.size(); ++next) {
+		int64_t overlap = (int64_t)(m[l].p2 + m[l].num - m[next].p2);
 		if (overlap >= 0) {
-			if (overlap >= nextL->num) {
-				b->matches.erase(nextL);
-				nextL = l;
+			if ((uint64_t)overlap >= m[next].num)
 				continue;
-			}
 			if (flags & BDELTA_REMOVE_OVERLAP)
-				l->num -= overlap;
+				m[l].num -= overlap;
 		}
+		m[++l] = m[next];
 	}
+	m.resize(l + 1, Match(0, 0, 0));
 }
 
 void bdelta_showMatches(BDelta_Instance *b) {
-	for (std::list<Match>::iterator l = b->matches.begin(); l != b->matches.end(); ++l)
-		printf("(%d, %d, %d), ", l->p1, l->p2, l->num);
+	for (std::vector<Match>::iterator l = b->matches.begin(); l != b->matches.end(); ++l)
+		printf("(%llu, %llu, %llu), ", (unsigned long long)l->p1, (unsigned long long)l->p2, (unsigned long long)l->num);
 	printf ("\n\n");
 }
 
 void get_unused_blocks(UnusedRange *unused, unsigned *numunusedptr) {
-	unsigned nextStartPos = 0;
+	uint64_t nextStartPos = 0;
 	for (unsigned i = 1; i < *numunusedptr; ++i) {
-		unsigned startPos = nextStartPos;
+		uint64_t startPos = nextStartPos;
 		nextStartPos = std::max(startPos, unused[i].p + unused[i].num);
 		unused[i] = UnusedRange(startPos, unused[i].p < startPos ? 0 : unused[i].p - startPos, unused[i-1].mr, unused[i].mr);
 	}
 }
 
-bool isZeroMatch(Match &m) {return m.num == 0;}
+// Tokens of the second input covered by matches, which are sorted by p2
+// and may overlap.
+static uint64_t matched_tokens(const std::vector<Match> &matches) {
+	uint64_t total = 0, end = 0;
+	for (std::vector<Match>::const_iterator l = matches.begin(); l != matches.end(); ++l) {
+		uint64_t from = std::max(l->p2, end), to = l->p2 + l->num;
+		if (to > from) {
+			total += to - from;
+			end = to;
+		}
+	}
+	return total;
+}
 
 void bdelta_pass(BDelta_Instance *b, unsigned blocksize, unsigned minMatchSize, unsigned maxHoleSize, unsigned flags) {
-	// Place an empty Match at beginning so we can assume there's a Match to the left of every hole.
-	b->matches.push_front(Match(0, 0, 0));
-	// Trick for including the free range at the end.
-	b->matches.push_back(Match(b->data1_size, b->data2_size, 0));
+	bdelta_pass_mt(b, blocksize, minMatchSize, maxHoleSize, flags, 1);
+}
+
+void bdelta_pass_mt(BDelta_Instance *b, unsigned blocksize, unsigned minMatchSize, unsigned maxHoleSize, unsigned flags, unsigned numThreads) {
+	if (numThreads < 1) numThreads = 1;
+	if (b->workspaces.size() < numThreads) b->workspaces.resize(numThreads);
+	for (size_t i = 0; i < b->workspaces.size(); ++i)
+		b->workspaces[i].clearStats();
+	b->counters.clear();
+	pendingReads.reads = pendingReads.bytes = 0;
+	std::chrono::steady_clock::time_point passStart = std::chrono::steady_clock::now();
+
+	// Surround the matches with empty ones so we can assume there's a Match
+	// to the left of every hole, and include the free range at the end.
+	std::vector<Match> &bounded = b->bounded;
+	bounded.clear();
+	bounded.push_back(Match(0, 0, 0));
+	bounded.insert(bounded.end(), b->matches.begin(), b->matches.end());
+	bounded.push_back(Match(b->data1_size, b->data2_size, 0));
 
-	UnusedRange *unused = new UnusedRange[b->matches.size() + 1],
-			    *unused2 = new UnusedRange[b->matches.size() + 1];
+	b->unused.resize(bounded.size() + 1);
+	b->unused2.resize(bounded.size() + 1);
+	UnusedRange *unused = &b->unused[0],
+			    *unused2 = &b->unused2[0];
 	unsigned numunused = 0, numunused2 = 0;
-	for (std::list<Match>::iterator l = b->matches.begin(); l != b->matches.end(); ++l) {
-		unused[numunused++] = UnusedRange(l->p1, l->num, l, l);
-		unused2[numunused2++] = UnusedRange(l->p2, l->num, l, l);
+	for (std::vector<Match>::iterator l = bounded.begin(); l != bounded.end(); ++l) {
+		unused[numunused++] = UnusedRange(l->p1, l->num, &*l, &*l);
+		unused2[numunused2++] = UnusedRange(l->p2, l->num, &*l, &*l);
 	}
 
 	std::sort(unused + 1, unused + numunused, comparep); // Leave empty match at beginning
@@ -409,52 +857,436 @@ void bdelta_pass(BDelta_Instance *b, unsigned blocksize, unsigned minMatchSize,
 	get_unused_blocks(unused,  &numunused);
 	get_unused_blocks(unused2, &numunused2);
 	//std::sort(unused2, unused2 + numunused2, comparemrp2);
+	uint64_t sortNanos = nanos_since(passStart);
 
-	if (flags & BDELTA_GLOBAL)
-		bdelta_pass_2(b, blocksize, minMatchSize, unused, numunused, unused2, numunused2);
-	else {
+	// Matches are collected per range so that ranges can be searched
+	// concurrently, then added in range order once the search is done.
+	std::vector<std::vector<Match> > &found = b->found;
+	std::vector<Match> &newMatches = b->newMatches;
+	newMatches.clear();
+	unsigned numfound;
+	if (flags & BDELTA_GLOBAL) {
+		numfound = numunused2;
+		if (found.size() < numfound) found.resize(numfound);
+		for (unsigned i = 0; i < numfound; ++i) found[i].clear();
+		bdelta_pass_2(b, blocksize, minMatchSize, unused, numunused, unused2, numunused2, &found[0], flags, b->workspaces[0], numThreads);
+	} else {
+		std::chrono::steady_clock::time_point sortStart = std::chrono::steady_clock::now();
 		std::sort(unused + 1, unused + numunused, comparemrp2);
+		std::vector<unsigned> &holes = b->holes;
+		holes.clear();
 		for (unsigned i = 1; i < numunused; ++i) {
 			UnusedRange u1 = unused[i], u2 = unused2[i];
 			if (u1.num >= blocksize && u2.num >= blocksize)
 				if (! maxHoleSize || (u1.num <= maxHoleSize && u2.num <= maxHoleSize))
-					if (! (flags & BDELTA_SIDES_ORDERED) || (bdelta_next(u1.ml) == u1.mr && bdelta_next(u2.ml) == u2.mr))
-						bdelta_pass_2(b, blocksize, minMatchSize, &u1, 1, &u2, 1);
+					if (! (flags & BDELTA_SIDES_ORDERED) || (u1.ml + 1 == u1.mr && u2.ml + 1 == u2.mr))
+						holes.push_back(i);
 		}
+		sortNanos += nanos_since(sortStart);
+		numfound = holes.size();
+		if (found.size() < numfound) found.resize(numfound);
+		for (unsigned k = 0; k < numfound; ++k) found[k].clear();
+		HoleTask holeTask(b, blocksize, minMatchSize, flags, unused, unused2, holes, found.empty() ? 0 : &found[0]);
+		run_tasks(holeTask, holes.size(), numThreads);
 	}
+	std::chrono::steady_clock::time_point mergeStart = std::chrono::steady_clock::now();
+	for (unsigned k = 0; k < numfound; ++k)
+		newMatches.insert(newMatches.end(), found[k].begin(), found[k].end());
+	addMatches(b, newMatches);
+	sortNanos += nanos_since(mergeStart);
 
-	if (verbose) printf("pass (blocksize: %u, matches: %lu)\n", blocksize, (unsigned long)b->matches.size());
+	bool sampled = false;
+	for (size_t i = 0; i < b->workspaces.size(); ++i) {
+		const Workspace &ws = b->workspaces[i];
+		b->stats.peakIndexBytes = std::max(b->stats.peakIndexBytes, ws.peakBytes);
+		b->stats.blocksIndexed += ws.blocksIndexed;
+		b->stats.blocksSkipped += ws.blocksSkipped;
+		sampled |= ws.sampled;
+	}
+	if (sampled) ++b->stats.sampledPasses;
+	++b->stats.numPasses;
+	b->stats.matchedTokens = matched_tokens(b->matches);
 
-	// Get rid of the dummy values we placed at the ends.
-	b->matches.erase(std::find_if(b->matches.begin(), b->matches.end(), isZeroMatch));
-	b->matches.pop_back();
+	b->counters.addReads(); // Those of this thread outside the tasks
+	const PassCounters &c = b->counters;
+	BDelta_PassStats ps;
+	ps.blockSize = blocksize;
+	ps.flags = flags;
+	ps.checksums = c.checksums;
+	ps.dropped = c.dropped;
+	ps.probes = c.probes;
+	ps.hits = c.hits;
+	ps.falseHits = c.falseHits;
+	ps.comparedTokens = c.comparedTokens;
+	ps.reads = c.reads;
+	ps.readBytes = c.readBytes;
+	ps.matchesAdded = newMatches.size();
+	ps.buildSeconds = c.buildNanos * 1e-9;
+	ps.scanSeconds = c.scanNanos * 1e-9;
+	ps.sortSeconds = sortNanos * 1e-9;
+	ps.seconds = nanos_since(passStart) * 1e-9;
+	b->passStats.push_back(ps);
 
-	delete [] unused;
-	delete [] unused2;
+	if (verbose) printf("pass (blocksize: %u, matches: %lu, matched: %llu)\n", blocksize, (unsigned long)b->matches.size(),
+		(unsigned long long)b->stats.matchedTokens);
+}
+
+void bdelta_run_passes(BDelta_Instance *b, const BDelta_Pass *passes, unsigned numPasses,
+		const BDelta_PlanLimits *limits, unsigned numThreads) {
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	uint64_t lastGain = (uint64_t)-1;
+	for (unsigned i = 0; i < numPasses; ++i) {
+		const BDelta_Pass &p = passes[i];
+		if (limits) {
+			if (limits->timeBudget > 0 &&
+					std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() >= limits->timeBudget)
+				break;
+			if (b->data2_size - b->stats.matchedTokens <= limits->minHoleTokens)
+				break;
+			if (!(p.flags & BDELTA_GLOBAL) && lastGain < limits->minGain)
+				continue;
+		}
+		uint64_t before = b->stats.matchedTokens;
+		bdelta_pass_mt(b, p.blockSize, p.minMatchSize, p.maxHoleSize, p.flags, numThreads);
+		bdelta_clean_matches(b, BDELTA_REMOVE_OVERLAP);
+		lastGain = b->stats.matchedTokens - before;
+	}
+}
+
+// One job of a batch, on the instance of the worker that took it.
+struct BatchTask {
+	BDelta_Instance **instances;
+	const BDelta_Batch *batch;
+	const std::vector<unsigned> &order;
+	const BDelta_Pass *passes;
+	unsigned numPasses;
+	const BDelta_PlanLimits *limits;
+
+	BatchTask(BDelta_Instance **instances, const BDelta_Batch *batch, const std::vector<unsigned> &order, const BDelta_Pass *passes, unsigned numPasses, const BDelta_PlanLimits *limits)
+		: instances(instances), batch(batch), order(order), passes(passes), numPasses(numPasses), limits(limits) {}
+	void operator() (uint64_t i, unsigned worker) {
+		BDelta_Instance *b = instances[worker];
+		unsigned job = order[i];
+		if (batch->open(batch->context, job, b)) return;
+		bdelta_run_passes(b, passes, numPasses, limits, 1);
+		batch->done(batch->context, job, b);
+	}
+};
+
+void bdelta_run_batch(BDelta_Instance **instances, unsigned numInstances, const BDelta_Batch *batch,
+		const BDelta_Pass *passes, unsigned numPasses, const BDelta_PlanLimits *limits) {
+	std::vector<unsigned> order(batch->numJobs);
+	for (unsigned i = 0; i < batch->numJobs; ++i) order[i] = i;
+	// Largest first, so no big job is left to run alone at the end.
+	const uint64_t *sizes = batch->jobSizes;
+	if (sizes)
+		std::stable_sort(order.begin(), order.end(), [sizes](unsigned x, unsigned y) {return sizes[x] > sizes[y];});
+	BatchTask task(instances, batch, order, passes, numPasses, limits);
+	run_tasks(task, order.size(), numInstances);
+}
+
+// Matches the common prefix and suffix, and with blocksize set, runs of
+// equal data at the same position every blocksize tokens in between.
+template <class Token>
+static void prepass(BDelta_Instance *b, unsigned blocksize, unsigned minMatchSize) {
+	uint64_t common = std::min(b->data1_size, b->data2_size),
+	         prefix = match_forward<Token>(b, 0, 0),
+	         suffix = std::min(match_backward<Token>(b, b->data1_size, b->data2_size, 4096), common - prefix);
+	std::vector<Match> &found = b->newMatches;
+	found.clear();
+	if (prefix && prefix >= minMatchSize)
+		found.push_back(Match(0, 0, prefix));
+	if (blocksize) {
+		uint64_t end = common - suffix, last = prefix;
+		for (uint64_t p = (prefix / blocksize + 1) * blocksize; p < end && end - p >= blocksize; ) {
+			uint64_t num = std::min(match_forward<Token>(b, p, p), end - p);
+			if (num < blocksize) {
+				p += blocksize;
+				continue;
+			}
+			uint64_t back = std::min(match_backward<Token>(b, p, p, blocksize), p - last);
+			if (back + num >= minMatchSize) {
+				found.push_back(Match(p - back, p - back, back + num));
+				last = p + num;
+			}
+			p = ((p + num) / blocksize + 1) * blocksize;
+		}
+	}
+	if (suffix && suffix >= minMatchSize)
+		found.push_back(Match(b->data1_size - suffix, b->data2_size - suffix, suffix));
+	addMatches(b, found);
+}
+
+void bdelta_prepass(BDelta_Instance *b, unsigned blockSize, unsigned minMatchSize) {
+	switch (b->tokenSize) {
+	case 1: prepass<uint8_t>(b, blockSize, minMatchSize); break;
+	case 2: prepass<uint16_t>(b, blockSize, minMatchSize); break;
+	case 4: prepass<uint32_t>(b, blockSize, minMatchSize); break;
+	}
+	b->stats.matchedTokens = matched_tokens(b->matches);
+	if (verbose) printf("prepass (matches: %lu, matched: %llu)\n", (unsigned long)b->matches.size(),
+		(unsigned long long)b->stats.matchedTokens);
 }
 
 unsigned bdelta_numMatches(BDelta_Instance *b) {
 	return b->matches.size();
 }
 
+void bdelta_getMatch64(BDelta_Instance *b, unsigned matchNum,
+		uint64_t *p1, uint64_t *p2, uint64_t *num) {
+	const Match &m = b->matches[matchNum];
+	*p1 = m.p1;
+	*p2 = m.p2;
+	*num = m.num;
+}
+
 void bdelta_getMatch(BDelta_Instance *b, unsigned matchNum,
 		unsigned *p1, unsigned *p2, unsigned *num) {
-	int &access_int = b->access_int;
-	std::list<Match>::iterator &accessplace = b->accessplace;
-	if (access_int == -1) {access_int = 0; accessplace = b->matches.begin();}
-	while ((unsigned)access_int < matchNum) {
-		++accessplace;
-		++access_int;
-	}
-	while ((unsigned)access_int > matchNum) {
-		--accessplace;
-		--access_int;
-	}
-	*p1 = accessplace->p1;
-	*p2 = accessplace->p2;
-	*num = accessplace->num;
+	uint64_t p1_64, p2_64, num64;
+	bdelta_getMatch64(b, matchNum, &p1_64, &p2_64, &num64);
+	*p1 = (unsigned)p1_64;
+	*p2 = (unsigned)p2_64;
+	*num = (unsigned)num64;
+}
+
+unsigned bdelta_getMatchRef(BDelta_Instance *b, unsigned matchNum, uint64_t *offset) {
+	const std::vector<uint64_t> &ends = b->refEnds;
+	uint64_t p1 = b->matches[matchNum].p1;
+	unsigned ref = (unsigned)(std::upper_bound(ends.begin(), ends.end(), p1) - ends.begin());
+	if (offset) *offset = p1 - (ref ? ends[ref - 1] : 0);
+	return ref;
+}
+
+template <class T>
+static unsigned getMatches(BDelta_Instance *b, unsigned start, unsigned count,
+		T *p1, T *p2, T *num) {
+	if (start >= b->matches.size()) return 0;
+	count = std::min<unsigned>(count, (unsigned)b->matches.size() - start);
+	const Match *m = &b->matches[start];
+	if (p1) for (unsigned i = 0; i < count; ++i) p1[i] = (T)m[i].p1;
+	if (p2) for (unsigned i = 0; i < count; ++i) p2[i] = (T)m[i].p2;
+	if (num) for (unsigned i = 0; i < count; ++i) num[i] = (T)m[i].num;
+	return count;
+}
+
+unsigned bdelta_getMatches(BDelta_Instance *b, unsigned start, unsigned count,
+		unsigned *p1, unsigned *p2, unsigned *num) {
+	return getMatches(b, start, count, p1, p2, num);
+}
+
+unsigned bdelta_getMatches64(BDelta_Instance *b, unsigned start, unsigned count,
+		uint64_t *p1, uint64_t *p2, uint64_t *num) {
+	return getMatches(b, start, count, p1, p2, num);
 }
 
 int bdelta_getError(BDelta_Instance *instance) {
 	return instance->errorcode;
 }
+
+// Reference signatures.  The file holds a SignatureHeader, then one
+// SignatureIndex per blocksize, then the arrays they point to at 64-byte
+// aligned offsets.  It is written in the byte order and layout of the
+// machine that made it; a file that doesn't match is rejected on load.
+
+struct SignatureHeader {
+	char magic[4];
+	uint32_t byteOrder, version;
+	uint32_t tokenSize, hashFlags;
+	uint32_t slotSize, numIndexes;
+	uint64_t size;
+};
+
+struct SignatureIndex {
+	uint32_t blocksize, reserved;
+	uint64_t numBuckets, numFilterWords; // No filter if numFilterWords is 0
+	uint64_t tagsOffset, slotsOffset, filterOffset;
+};
+
+static const uint32_t signatureByteOrder = 0x01020304;
+
+template <class Loc>
+static void delete_indexes(std::vector<void *> &indexes) {
+	for (size_t i = 0; i < indexes.size(); ++i)
+		delete (ChecksumIndex<Loc> *)indexes[i];
+}
+
+_BDelta_Signature::~_BDelta_Signature() {
+	if (wide()) delete_indexes<uint64_t>(indexes);
+	else delete_indexes<uint32_t>(indexes);
+#ifdef BDELTA_HAVE_MMAP
+	if (mapping) munmap(mapping, (size_t)mappingSize);
+#else
+	delete [] (char *)mapping;
+#endif
+}
+
+template <class Hash, class Loc>
+static void *build_signature_index(BDelta_Instance *b, unsigned blocksize, unsigned numThreads) {
+	UnusedRange all(0, b->data1_size, 0, 0);
+	std::vector<uint64_t> firstBlock, hashes;
+	uint64_t numblocks = count_blocks(&all, 1, blocksize, firstBlock);
+	typename Hash::Window w(blocksize);
+	ChecksumIndex<Loc> *h = new ChecksumIndex<Loc>(blocksize, numblocks);
+	fill_index<Hash>(b, w, *h, &all, 1, firstBlock, hashes, 0, 0, numThreads);
+	return h;
+}
+
+template <class Hash>
+static void *build_signature_index(BDelta_Instance *b, unsigned blocksize, unsigned numThreads) {
+	if (b->data1_size < 0xffffffff)
+		return build_signature_index<Hash, uint32_t>(b, blocksize, numThreads);
+	return build_signature_index<Hash, uint64_t>(b, blocksize, numThreads);
+}
+
+template <class Token>
+static void *build_signature_index(BDelta_Instance *b, unsigned blocksize, unsigned hashFlags, unsigned numThreads) {
+	switch (hashFlags) {
+	case BDELTA_HASH_BUZHASH: return build_signature_index<BuzHash<Token> >(b, blocksize, numThreads);
+	case BDELTA_HASH_CRC32C: return build_signature_index<Crc32cHash<Token> >(b, blocksize, numThreads);
+	default: return build_signature_index<PolynomialHash<Token> >(b, blocksize, numThreads);
+	}
+}
+
+BDelta_Signature *bdelta_signature_build(BDelta_Instance *b, const unsigned *blocksizes, unsigned numBlocksizes,
+		unsigned flags, unsigned numThreads) {
+	BDelta_Signature *sig = new BDelta_Signature(b->tokenSize, flags & BDELTA_HASH_MASK, b->data1_size);
+	for (unsigned i = 0; i < numBlocksizes; ++i) {
+		if (!blocksizes[i] || sig->find(blocksizes[i])) continue;
+		void *index;
+		switch (b->tokenSize) {
+		case 2: index = build_signature_index<uint16_t>(b, blocksizes[i], sig->hashFlags, numThreads); break;
+		case 4: index = build_signature_index<uint32_t>(b, blocksizes[i], sig->hashFlags, numThreads); break;
+		default: index = build_signature_index<uint8_t>(b, blocksizes[i], sig->hashFlags, numThreads); break;
+		}
+		sig->blocksizes.push_back(blocksizes[i]);
+		sig->indexes.push_back(index);
+	}
+	return sig;
+}
+
+static uint64_t align64(uint64_t offset) {return (offset + 63) & ~(uint64_t)63;}
+
+static bool write_at(FILE *f, uint64_t offset, const void *data, uint64_t num) {
+	if (fseek64(f, (int64_t)offset, SEEK_SET)) return false;
+	return fwrite(data, 1, (size_t)num, f) == num;
+}
+
+template <class Loc>
+static int save_signature(const BDelta_Signature *sig, FILE *f) {
+	typedef ChecksumIndex<Loc> Index;
+	SignatureHeader header;
+	memcpy(header.magic, "BDS", 4);
+	header.byteOrder = signatureByteOrder;
+	header.version = 1;
+	header.tokenSize = sig->tokenSize;
+	header.hashFlags = sig->hashFlags;
+	header.slotSize = sizeof(typename Index::Slot);
+	header.numIndexes = (uint32_t)sig->indexes.size();
+	header.size = sig->size;
+
+	std::vector<SignatureIndex> entries(sig->indexes.size());
+	uint64_t offset = sizeof(header) + entries.size() * sizeof(SignatureIndex);
+	for (size_t i = 0; i < entries.size(); ++i) {
+		const Index *h = (const Index *)sig->indexes[i];
+		SignatureIndex &e = entries[i];
+		e.blocksize = h->blocksize;
+		e.reserved = 0;
+		e.numBuckets = h->numBuckets();
+		e.numFilterWords = h->filter ? h->filter->numwords : 0;
+		e.tagsOffset = offset = align64(offset);
+		offset += e.numBuckets * Index::bucketSlots;
+		e.slotsOffset = offset = align64(offset);
+		offset += e.numBuckets * Index::bucketSlots * sizeof(typename Index::Slot);
+		e.filterOffset = offset = align64(offset);
+		offset += e.numFilterWords * sizeof(uint64_t);
+	}
+
+	if (!write_at(f, 0, &header, sizeof(header))) return BDELTA_WRITE_ERROR;
+	if (!entries.empty() && !write_at(f, sizeof(header), &entries[0], entries.size() * sizeof(SignatureIndex)))
+		return BDELTA_WRITE_ERROR;
+	for (size_t i = 0; i < entries.size(); ++i) {
+		const Index *h = (const Index *)sig->indexes[i];
+		const SignatureIndex &e = entries[i];
+		if (!write_at(f, e.tagsOffset, h->tags, e.numBuckets * Index::bucketSlots) ||
+		    !write_at(f, e.slotsOffset, h->slots, e.numBuckets * Index::bucketSlots * sizeof(typename Index::Slot)) ||
+		    (e.numFilterWords && !write_at(f, e.filterOffset, h->filter->words, e.numFilterWords * sizeof(uint64_t))))
+			return BDELTA_WRITE_ERROR;
+	}
+	return BDELTA_OK;
+}
+
+int bdelta_signature_save(const BDelta_Signature *sig, const char *path) {
+	FILE *f = fopen(path, "wb");
+	if (!f) return BDELTA_WRITE_ERROR;
+	int result = sig->wide() ? save_signature<uint64_t>(sig, f) : save_signature<uint32_t>(sig, f);
+	if (fclose(f) && result == BDELTA_OK) result = BDELTA_WRITE_ERROR;
+	return result;
+}
+
+// Sets up views of the indexes in sig's loaded file.
+template <class Loc>
+static bool load_indexes(BDelta_Signature *sig, const SignatureHeader &header) {
+	typedef ChecksumIndex<Loc> Index;
+	char *data = (char *)sig->mapping;
+	uint64_t size = sig->mappingSize;
+	if (header.slotSize != sizeof(typename Index::Slot)) return false;
+	if (sizeof(header) + (uint64_t)header.numIndexes * sizeof(SignatureIndex) > size) return false;
+	const SignatureIndex *entries = (const SignatureIndex *)(data + sizeof(header));
+	for (uint32_t i = 0; i < header.numIndexes; ++i) {
+		const SignatureIndex &e = entries[i];
+		uint64_t numSlots = e.numBuckets * Index::bucketSlots;
+		bool fits = e.blocksize && e.numBuckets && !(e.numBuckets & (e.numBuckets - 1)) &&
+			e.tagsOffset <= size && numSlots <= size - e.tagsOffset &&
+			e.slotsOffset <= size && numSlots <= (size - e.slotsOffset) / sizeof(typename Index::Slot) &&
+			e.filterOffset <= size && e.numFilterWords <= (size - e.filterOffset) / sizeof(uint64_t) &&
+			!(e.numFilterWords & (e.numFilterWords - 1));
+		if (!fits) return false;
+		ChecksumFilter *filter = e.numFilterWords ? new ChecksumFilter((uint64_t *)(data + e.filterOffset), e.numFilterWords) : 0;
+		sig->blocksizes.push_back(e.blocksize);
+		sig->indexes.push_back(new Index(e.blocksize, e.numBuckets, (uint8_t *)(data + e.tagsOffset),
+			(typename Index::Slot *)(data + e.slotsOffset), filter));
+	}
+	return true;
+}
+
+BDelta_Signature *bdelta_signature_load(const char *path) {
+	FILE *f = fopen(path, "rb");
+	if (!f) return 0;
+	SignatureHeader header;
+	bool ok = fread(&header, 1, sizeof(header), f) == sizeof(header) &&
+		!memcmp(header.magic, "BDS", 4) && header.byteOrder == signatureByteOrder && header.version == 1 &&
+		(header.tokenSize == 1 || header.tokenSize == 2 || header.tokenSize == 4) &&
+		!fseek64(f, 0, SEEK_END);
+	int64_t fileSize = ok ? ftell64(f) : -1;
+	if (fileSize < 0) {fclose(f); return 0;}
+
+	BDelta_Signature *sig = new BDelta_Signature(header.tokenSize, header.hashFlags & BDELTA_HASH_MASK, header.size);
+	sig->mappingSize = (uint64_t)fileSize;
+#ifdef BDELTA_HAVE_MMAP
+	// Mapped read-only and shared, so processes using the same file share its pages.
+	void *m = mmap(0, (size_t)fileSize, PROT_READ, MAP_SHARED, fileno(f), 0);
+	sig->mapping = m == MAP_FAILED ? 0 : m;
+#else
+	char *m = new char[(size_t)fileSize];
+	fseek64(f, 0, SEEK_SET);
+	if (fread(m, 1, (size_t)fileSize, f) == (size_t)fileSize) sig->mapping = m;
+	else delete [] m;
+#endif
+	fclose(f);
+	if (!sig->mapping || !(sig->wide() ? load_indexes<uint64_t>(sig, header) : load_indexes<uint32_t>(sig, header))) {
+		delete sig;
+		return 0;
+	}
+	return sig;
+}
+
+void bdelta_signature_free(BDelta_Signature *sig) {
+	delete sig;
+}
+
+int bdelta_use_signature(BDelta_Instance *b, const BDelta_Signature *sig) {
+	if (sig && (sig->tokenSize != b->tokenSize || sig->size != b->data1_size))
+		return BDELTA_SIGNATURE_MISMATCH;
+	b->signature = sig;
+	return BDELTA_OK;
+}
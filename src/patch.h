@@ -0,0 +1,248 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ * License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/. */
+
+// Writes a patch in the format described in README.
+//
+// A version 1 patch is produced in one pass over the matches: each match
+// record and the unmatched data in front of it are emitted together.  Since
+// the size of the record section is known up front, records and unmatched
+// data are gathered in separate buffers, each flushed to its own region of
+// the file.
+//
+// In version 2 the records are varints, whose total size isn't known until
+// the last match, so the three columns are kept in memory and the
+// unmatched data is written after them in finish().  Version 3 is version
+// 2 compressed, and goes through a Compressor on its way to the file.
+//
+// Version 4 splits the output into chunks of chunkSize bytes, each written
+// as its matches are complete, so only one chunk's records are held at a
+// time.  Matches crossing a chunk boundary are split there.
+//
+// A patch against several references, with "bdelta --ref", sets the
+// multipleReferences bit of the version field of versions 2 to 4 and lists
+// the reference sizes after file 1's size, which is their total.  Matches
+// locate into the references as if they were one file, one after another.
+//
+// Include after file.h and codec.h.
+
+#include <string.h>
+#include <algorithm>
+#include <vector>
+
+typedef const void *(*patch_readCallback)(void *handle, void *buf, uint64_t place, unsigned num);
+
+class PatchWriter {
+public:
+	static const unsigned bufSize = 1 << 20;
+
+	// Data not covered by matches is read from the new file with read(handle2, ...).
+	// version is the patch format version, 1 or 2.  A codec other than
+	// CODEC_NONE compresses a version 2 patch into version 3.  A chunkSize
+	// writes a version 4 patch instead.  refSizes, if there are several,
+	// are the sizes of the references that make up file 1; version 1 can't
+	// have them.
+	PatchWriter(FILE *f, uint64_t size1, uint64_t size2, unsigned nummatches,
+			patch_readCallback read, void *handle2, unsigned version = 1,
+			unsigned codec = CODEC_NONE, int level = 0, uint64_t chunkSize = 0,
+			const std::vector<uint64_t> &refSizes = std::vector<uint64_t>())
+		: version(chunkSize ? 4 : codec != CODEC_NONE ? 3 : version),
+		  intsize((size1 > 0xffffffff || size2 > 0xffffffff) ? 8 : 4),
+		  records(f, (uint64_t)0, bufSize),
+		  literals(f, 3 + 2 + 1 + 3 * intsize + (uint64_t)nummatches * 3 * intsize, this->version == 1 ? bufSize : 1) {
+		this->size1 = size1;
+		this->size2 = size2;
+		this->nummatches = nummatches;
+		this->read = read;
+		this->handle2 = handle2;
+		this->f = f;
+		this->codec = codec;
+		this->level = level;
+		this->chunkSize = chunkSize;
+		if (refSizes.size() > 1) this->refSizes = refSizes;
+		lastp1 = lastp2 = 0;
+		count = 0;
+
+		if (this->version == 4) {
+			records.write("BDT", 3);
+			records.write_uint(4 | flags(), 2); // version
+			put_sizes(records);
+			put_varint(records, chunkSize);
+			chunkStart = 0;
+		}
+		if (this->version != 1) return;
+		if (!this->refSizes.empty()) throw "a patch against several references needs version 2 or later";
+		records.write("BDT", 3);
+		records.write_uint(1, 2); // version
+		unsigned char isize = intsize;
+		records.write(&isize, 1);
+		uint64_t header[3] = {size1, size2, nummatches};
+		records.write_uints(header, 3, intsize);
+	}
+
+	// Matches must be added in order of p2.
+	void addMatch(uint64_t p1, uint64_t p2, uint64_t num) {
+		if (version == 4) {
+			// Locations in the reference are absolute, so chunks stand alone.
+			while (num) {
+				uint64_t chunkEnd = chunkStart + chunkSize;
+				if (p2 >= chunkEnd) {
+					finish_chunk();
+					continue;
+				}
+				uint64_t n = std::min(num, chunkEnd - p2);
+				put_varint(columns[0], p1);
+				put_varint(columns[1], p2 - lastp2);
+				put_varint(columns[2], n);
+				++count;
+				lastp2 = p2 + n;
+				p1 += n;
+				p2 += n;
+				num -= n;
+			}
+			return;
+		}
+		if (version == 1) {
+			uint64_t record[3] = {p1 - lastp1, p2 - lastp2, num};
+			records.write_uints(record, 3, intsize);
+			put_literal(literals, lastp2, p2 - lastp2);
+		} else {
+			put_varint(columns[0], zigzag_encode(p1 - lastp1));
+			put_varint(columns[1], p2 - lastp2);
+			put_varint(columns[2], num);
+			++count;
+		}
+		lastp1 = p1 + num;
+		lastp2 = p2 + num;
+	}
+
+	// Emits the data after the last match and flushes everything.
+	void finish() {
+		if (version == 1) {
+			put_literal(literals, lastp2, size2 - lastp2);
+			records.flush();
+			literals.flush();
+			return;
+		}
+		if (version == 4) {
+			while (chunkStart < size2)
+				finish_chunk();
+			// The index of chunk sizes, and where it starts.
+			uint64_t indexPos = records.tell();
+			put_varint(records, chunkBytes.size());
+			for (size_t i = 0; i < chunkBytes.size(); ++i)
+				put_varint(records, chunkBytes[i]);
+			records.write_uint(indexPos, 8);
+			records.flush();
+			return;
+		}
+
+		Compressor *compressor = 0;
+		BufferedWriter *packed = 0;
+		if (version == 3) {
+			// Everything after the codec is compressed.
+			unsigned char start[6] = {'B', 'D', 'T', 3, (unsigned char)(flags() >> 8), (unsigned char)codec};
+			fwrite_fixed(f, start, 6);
+			compressor = Compressor::create(codec, level, f);
+			packed = new BufferedWriter(compressor, bufSize);
+		}
+		finish_v2(packed ? *packed : records);
+		if (packed) {
+			delete packed;
+			compressor->finish();
+			delete compressor;
+		}
+	}
+
+private:
+	unsigned version, intsize;
+	BufferedWriter records, literals;
+	uint64_t size1, size2, lastp1, lastp2;
+	unsigned nummatches;
+	patch_readCallback read;
+	void *handle2;
+	FILE *f;
+	unsigned codec;
+	int level;
+	std::vector<unsigned char> columns[3]; // Versions 2 to 4: copyloc1, copyloc2 and copynum
+	uint64_t count; // Matches in columns
+	uint64_t chunkSize, chunkStart; // Version 4
+	std::vector<uint64_t> chunkBytes;
+	std::vector<uint64_t> refSizes; // If there are several references
+
+	unsigned flags() const {return refSizes.empty() ? 0 : multipleReferences;}
+
+	// Writes the sizes of file 1, with those of its references, and file 2.
+	void put_sizes(BufferedWriter &out) {
+		put_varint(out, size1);
+		if (!refSizes.empty()) {
+			put_varint(out, refSizes.size());
+			for (size_t i = 0; i < refSizes.size(); ++i)
+				put_varint(out, refSizes[i]);
+		}
+		put_varint(out, size2);
+	}
+
+	// Writes the rest of a version 2 patch to records, or the part of a
+	// version 3 patch after the codec.
+	void finish_v2(BufferedWriter &records) {
+		if (version == 2) {
+			records.write("BDT", 3);
+			records.write_uint(2 | flags(), 2); // version
+		}
+		put_sizes(records);
+		write_records(records, 0, size2);
+		records.flush();
+	}
+
+	// Writes the version 4 chunk starting at chunkStart, and starts the next.
+	void finish_chunk() {
+		uint64_t pos = records.tell();
+		write_records(records, chunkStart, std::min(chunkStart + chunkSize, size2));
+		chunkBytes.push_back(records.tell() - pos);
+		for (unsigned i = 0; i < 3; ++i) columns[i].clear();
+		count = 0;
+		chunkStart += chunkSize;
+		lastp2 = chunkStart;
+	}
+
+	// Writes the match count and columns, then the unmatched data between
+	// start and end of the new file, in the order of the matches.
+	void write_records(BufferedWriter &out, uint64_t start, uint64_t end) {
+		put_varint(out, count);
+		for (unsigned i = 0; i < 3; ++i)
+			put_varint(out, columns[i].size());
+		for (unsigned i = 0; i < 3; ++i)
+			if (!columns[i].empty()) out.write(&columns[i][0], columns[i].size());
+
+		const unsigned char *gap = columns[1].empty() ? 0 : &columns[1][0], *gapEnd = gap + columns[1].size(),
+		                    *len = columns[2].empty() ? 0 : &columns[2][0], *lenEnd = len + columns[2].size();
+		uint64_t place = start, g, n;
+		while (decode_varint(gap, gapEnd, g) && decode_varint(len, lenEnd, n)) {
+			put_literal(out, place, g);
+			place += g + n;
+		}
+		put_literal(out, place, end - place);
+	}
+
+	static void put_varint(std::vector<unsigned char> &v, uint64_t number) {
+		unsigned char buf[10];
+		v.insert(v.end(), buf, encode_varint(buf, number));
+	}
+	static void put_varint(BufferedWriter &out, uint64_t number) {
+		unsigned char buf[10];
+		out.write(buf, encode_varint(buf, number) - buf);
+	}
+
+	void put_literal(BufferedWriter &out, uint64_t place, uint64_t num) {
+		while (num) {
+			unsigned towrite = (unsigned)std::min<uint64_t>(num, bufSize);
+			unsigned char *dest = out.reserve(towrite);
+			const void *src = read(handle2, dest, place, towrite);
+			if (src != dest) memcpy(dest, src, towrite);
+			out.commit(towrite);
+			place += towrite;
+			num -= towrite;
+		}
+	}
+};
@@ -0,0 +1,530 @@
+/* Any copyright is dedicated to the Public Domain.
+ * http://creativecommons.org/publicdomain/zero/1.0/ */
+
+// Benchmarks for BDelta, run by "make bench" in src/.
+//
+// A corpus of old/new file pairs is generated from a fixed seed, so every
+// machine and commit diffs the same data: an executable with relinked
+// functions, a rotated text log, a VM image of 4KB blocks, and random data
+// with scattered edits.  Then come microbenchmarks of the inner loops, and
+// end-to-end runs of bdelta and bpatch on each pair, timed and with their
+// peak RSS.  Patch sizes are printed too, as they should only change when
+// the algorithm does.
+//
+// Output is one "name<TAB>value<TAB>unit" line per result, so that runs
+// from two commits can be compared with "bdelta_bench --compare old new".
+//
+// Needs POSIX, for running and measuring the tools.
+
+#include "compatibility.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include <map>
+#include <algorithm>
+#include <chrono>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <unistd.h>
+#include "bdelta.h"
+#include "checksum.h"
+#include "compare.h"
+#include "checksum_index.h"
+
+typedef std::vector<unsigned char> Bytes;
+
+// splitmix64, so the corpus is the same everywhere
+struct Random {
+	uint64_t state;
+	Random(uint64_t seed) : state(seed) {}
+	uint64_t next() {
+		uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+		z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+		z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+		return z ^ (z >> 31);
+	}
+	unsigned below(unsigned n) {return (unsigned)(next() % n);}
+	void fill(unsigned char *p, size_t num) {
+		for (size_t i = 0; i < num; ++i) p[i] = (unsigned char)next();
+	}
+};
+
+static void append_random(Bytes &out, Random &rnd, size_t num) {
+	size_t at = out.size();
+	out.resize(at + num);
+	rnd.fill(&out[at], num);
+}
+
+// Functions of skewed "instructions", laid out in a random order and
+// linked again with some of them changed, added or dropped, and addresses
+// throughout shifted.
+static void make_binary(size_t size, Bytes &f1, Bytes &f2) {
+	Random rnd(1);
+	std::vector<Bytes> funcs(4096);
+	for (size_t i = 0; i < funcs.size(); ++i) {
+		unsigned len = 64 + rnd.below(4000);
+		for (unsigned j = 0; j < len; ++j)
+			funcs[i].push_back((unsigned char)(rnd.below(4) ? rnd.below(32) : rnd.next()));
+	}
+	while (f1.size() < size) {
+		const Bytes &fn = funcs[rnd.below(funcs.size())];
+		f1.insert(f1.end(), fn.begin(), fn.end());
+		int r = rnd.below(100);
+		Bytes g(fn);
+		if (r < 3)
+			append_random(f2, rnd, fn.size()); // Rewritten
+		else if (r < 5) {
+			// Dropped
+		} else {
+			if (r < 15) {
+				// Addresses in it moved
+				for (size_t p = rnd.below(512); p + 4 <= g.size(); p += 256 + rnd.below(512))
+					rnd.fill(&g[p], 4);
+			}
+			f2.insert(f2.end(), g.begin(), g.end());
+		}
+		if (rnd.below(100) < 2) append_random(f2, rnd, 64 + rnd.below(2000)); // Added
+	}
+	f1.resize(size);
+}
+
+// A log of a few services, rotated: the start is gone and new lines follow
+// the end.
+static void make_log(size_t size, Bytes &f1, Bytes &f2) {
+	Random rnd(2);
+	static const char *const words[] = {"request", "served", "in", "ms", "user", "session", "opened", "closed",
+		"cache", "miss", "hit", "error", "retry", "timeout", "connection", "from", "to", "bytes", "GET", "POST",
+		"/api/v1/items", "/login", "/static/app.js", "ok", "failed", "worker", "started", "stopped"};
+	const unsigned numWords = sizeof(words) / sizeof(words[0]);
+	std::string log;
+	uint64_t t = 1700000000000ull;
+	size_t rotateAt = size / 10, oldEnd = size;
+	std::string old;
+	while (log.size() < size + size / 7) {
+		char line[256];
+		t += rnd.below(50);
+		int n = snprintf(line, sizeof(line), "%llu.%03u host%u svc%u[%u]:", (unsigned long long)(t / 1000),
+			(unsigned)(t % 1000), rnd.below(4), rnd.below(8), 1000 + rnd.below(30000));
+		unsigned count = 3 + rnd.below(12);
+		for (unsigned i = 0; i < count && n < 200; ++i)
+			n += snprintf(line + n, sizeof(line) - n, " %s", words[rnd.below(numWords)]);
+		n += snprintf(line + n, sizeof(line) - n, " %u\n", rnd.below(100000));
+		log.append(line, n);
+		if (old.empty() && log.size() >= oldEnd) old = log;
+	}
+	f1.assign(old.begin(), old.end());
+	f2.assign(log.begin() + std::min(rotateAt, log.size()), log.end());
+}
+
+// 4KB blocks, many of them zero or copies of each other, with some
+// rewritten and some moved.
+static void make_image(size_t size, Bytes &f1, Bytes &f2) {
+	Random rnd(3);
+	const size_t block = 4096, numblocks = size / block;
+	std::vector<Bytes> pool(numblocks / 4 + 1);
+	for (size_t i = 0; i < pool.size(); ++i) append_random(pool[i], rnd, block);
+	std::vector<unsigned> layout(numblocks);
+	for (size_t i = 0; i < numblocks; ++i)
+		layout[i] = rnd.below(10) < 4 ? (unsigned)-1 : rnd.below(pool.size());
+	Bytes zero(block, 0);
+	for (size_t i = 0; i < numblocks; ++i) {
+		const Bytes &b = layout[i] == (unsigned)-1 ? zero : pool[layout[i]];
+		f1.insert(f1.end(), b.begin(), b.end());
+	}
+	for (size_t i = 0; i < numblocks; ++i) {
+		unsigned r = rnd.below(100);
+		if (r < 5)
+			append_random(f2, rnd, block);
+		else {
+			size_t from = r < 7 ? rnd.below(numblocks) : i;
+			f2.insert(f2.end(), f1.begin() + from * block, f1.begin() + (from + 1) * block);
+		}
+	}
+}
+
+// Random data with inserts, deletes and overwrites scattered through it.
+static void make_random(size_t size, Bytes &f1, Bytes &f2) {
+	Random rnd(4);
+	append_random(f1, rnd, size);
+	size_t p = 0;
+	while (p < size) {
+		size_t run = std::min<size_t>(size - p, size / 100 + rnd.below(size / 50 + 1));
+		f2.insert(f2.end(), f1.begin() + p, f1.begin() + p + run);
+		p += run;
+		unsigned len = 1 + rnd.below(1000);
+		switch (rnd.below(3)) {
+		case 0: append_random(f2, rnd, len); break;
+		case 1: p += len; break;
+		case 2: append_random(f2, rnd, len); p += len; break;
+		}
+	}
+}
+
+struct CorpusEntry {
+	const char *name;
+	void (*make)(size_t size, Bytes &f1, Bytes &f2);
+};
+static const CorpusEntry corpus[] = {
+	{"binary", make_binary},
+	{"log", make_log},
+	{"image", make_image},
+	{"random", make_random},
+};
+static const unsigned corpusSize = sizeof(corpus) / sizeof(corpus[0]);
+
+static bool exists(const std::string &path) {
+	struct stat st;
+	return stat(path.c_str(), &st) == 0;
+}
+
+static void write_file(const std::string &path, const Bytes &data) {
+	FILE *f = fopen(path.c_str(), "wb");
+	if (!f || fwrite(data.empty() ? "" : (const char *)&data[0], 1, data.size(), f) != data.size()) {
+		fprintf(stderr, "couldn't write %s\n", path.c_str());
+		exit(1);
+	}
+	fclose(f);
+}
+
+static Bytes read_file(const std::string &path) {
+	Bytes data;
+	FILE *f = fopen(path.c_str(), "rb");
+	if (!f) return data;
+	unsigned char buf[1 << 16];
+	size_t n;
+	while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+		data.insert(data.end(), buf, buf + n);
+	fclose(f);
+	return data;
+}
+
+// Makes any of the corpus's files missing from dir.
+static void make_corpus(const std::string &dir, size_t size) {
+	mkdir(dir.c_str(), 0777);
+	for (unsigned i = 0; i < corpusSize; ++i) {
+		std::string base = dir + "/" + corpus[i].name;
+		if (exists(base + ".1") && exists(base + ".2")) continue;
+		Bytes f1, f2;
+		corpus[i].make(size, f1, f2);
+		write_file(base + ".1", f1);
+		write_file(base + ".2", f2);
+	}
+}
+
+static void report(const std::string &name, double value, const char *unit) {
+	printf("%s\t%.3f\t%s\n", name.c_str(), value, unit);
+	fflush(stdout);
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Results of the microbenchmarks go here, so they can't be optimized away.
+static volatile uint64_t sink;
+
+const unsigned repeats = 3;
+
+template <class Hash>
+static void bench_hash(const char *name, const Bytes &data, unsigned blocksize) {
+	typename Hash::Window w(blocksize);
+	double best = 1e30;
+	for (unsigned r = 0; r < repeats; ++r) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		Hash h(w, &data[0]);
+		uint64_t x = 0;
+		for (size_t i = blocksize; i < data.size(); ++i) {
+			h.advance(data[i - blocksize], data[i]);
+			x ^= h.getValue();
+		}
+		sink = x;
+		best = std::min(best, seconds_since(start));
+	}
+	report(std::string("hash_roll_") + name, data.size() / best / 1e6, "MB/s");
+}
+
+static void bench_compare(size_t size) {
+	Bytes a(size), b;
+	Random rnd(5);
+	rnd.fill(&a[0], size);
+	b = a;
+	double best = 1e30;
+	for (unsigned r = 0; r < repeats; ++r) {
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		sink = match_bytes_forward(&a[0], &b[0], size);
+		best = std::min(best, seconds_since(start));
+	}
+	report("match_forward", size / best / 1e6, "MB/s");
+}
+
+// Adding and finding checksums, with half the lookups missing.
+static void bench_index(unsigned numentries) {
+	Random rnd(6);
+	std::vector<uint64_t> keys(numentries);
+	for (unsigned i = 0; i < numentries; ++i) keys[i] = rnd.next();
+	double bestAdd = 1e30, bestFind = 1e30;
+	for (unsigned r = 0; r < repeats; ++r) {
+		ChecksumIndex<uint32_t> h(31, numentries);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < numentries; ++i) h.add(keys[i], i);
+		bestAdd = std::min(bestAdd, seconds_since(start));
+		Random probe(7);
+		uint64_t found = 0;
+		start = std::chrono::steady_clock::now();
+		for (unsigned i = 0; i < numentries; ++i)
+			found += h.find(i & 1 ? keys[probe.below(numentries)] : probe.next()) != 0;
+		sink = found;
+		bestFind = std::min(bestFind, seconds_since(start));
+	}
+	report("index_add", numentries / bestAdd / 1e6, "M/s");
+	report("index_find", numentries / bestFind / 1e6, "M/s");
+}
+
+// Table build and scan of one global pass over a corpus pair, from the
+// pass stats.
+static void bench_pass(const std::string &name, const Bytes &f1, const Bytes &f2, unsigned blocksize) {
+	double bestBuild = 1e30, bestScan = 1e30;
+	for (unsigned r = 0; r < repeats; ++r) {
+		BDelta_Instance *b = bdelta_init_mem(&f1[0], f1.size(), &f2[0], f2.size(), 1);
+		bdelta_pass(b, blocksize, blocksize * 2, 0, BDELTA_GLOBAL);
+		BDelta_PassStats ps;
+		bdelta_get_pass_stats(b, 0, &ps);
+		bdelta_done_alg(b);
+		bestBuild = std::min(bestBuild, ps.buildSeconds);
+		bestScan = std::min(bestScan, ps.scanSeconds);
+	}
+	char suffix[32];
+	snprintf(suffix, sizeof(suffix), "_%s_%u", name.c_str(), blocksize);
+	report(std::string("pass_build") + suffix, f1.size() / bestBuild / 1e6, "MB/s");
+	report(std::string("pass_scan") + suffix, f2.size() / bestScan / 1e6, "MB/s");
+}
+
+static bool read_all(int fd, void *buf, size_t num) {
+	char *p = (char *)buf;
+	while (num) {
+		ssize_t r = read(fd, p, num);
+		if (r <= 0) return false;
+		p += r;
+		num -= r;
+	}
+	return true;
+}
+
+// Runs the tools from a small process forked before anything else.  A
+// process forked from this one would count this one's memory in its peak
+// RSS, even after exec.
+class Launcher {
+public:
+	void start() {
+		int req[2], rep[2];
+		if (pipe(req) || pipe(rep)) {
+			perror("pipe");
+			exit(1);
+		}
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(req[1]);
+			close(rep[0]);
+			serve(req[0], rep[1]);
+			_exit(0);
+		}
+		close(req[0]);
+		close(rep[1]);
+		out = req[1];
+		in = rep[0];
+	}
+
+	// Runs args to completion, returning its wall time in seconds and
+	// setting its peak RSS in KB.  Returns a negative time if it failed.
+	double run(const std::vector<std::string> &args, long &maxrss) {
+		std::string msg;
+		for (size_t i = 0; i < args.size(); ++i) msg += args[i] + '\0';
+		uint32_t len = msg.size();
+		Reply reply;
+		if (write(out, &len, 4) != 4 || write(out, msg.data(), len) != (ssize_t)len ||
+				!read_all(in, &reply, sizeof(reply)))
+			return -1;
+		maxrss = reply.maxrss;
+		return reply.seconds;
+	}
+
+private:
+	struct Reply {
+		double seconds;
+		long maxrss;
+	};
+	int in, out;
+
+	static void serve(int in, int out) {
+		uint32_t len;
+		while (read_all(in, &len, 4)) {
+			std::string msg(len, 0);
+			if (!read_all(in, &msg[0], len)) return;
+			std::vector<char *> argv;
+			for (size_t p = 0; p < msg.size(); p = msg.find('\0', p) + 1)
+				argv.push_back(&msg[p]);
+			argv.push_back(NULL);
+			Reply reply = {-1, 0};
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			pid_t pid = fork();
+			if (pid == 0) {
+				execv(argv[0], &argv[0]);
+				_exit(127);
+			}
+			int status;
+			struct rusage usage;
+			if (pid > 0 && wait4(pid, &status, 0, &usage) == pid) {
+				reply.maxrss = usage.ru_maxrss;
+				if (WIFEXITED(status) && WEXITSTATUS(status) == 0) reply.seconds = seconds_since(start);
+			}
+			if (write(out, &reply, sizeof(reply)) != sizeof(reply)) return;
+		}
+	}
+};
+
+static Launcher launcher;
+
+static uint64_t file_size(const std::string &path) {
+	struct stat st;
+	return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+}
+
+// bdelta and bpatch on one pair: throughput of the new file, peak RSS and
+// the patch size.  The rebuilt file is checked.
+static bool bench_tools(const std::string &bindir, const std::string &base, const std::string &name) {
+	std::string f1 = base + ".1", f2 = base + ".2", patch = base + ".patch", out = base + ".out";
+	double bestDelta = 1e30, bestPatch = 1e30;
+	long rssDelta = 0, rssPatch = 0;
+	for (unsigned r = 0; r < repeats; ++r) {
+		long rss;
+		std::vector<std::string> args;
+		args.push_back(bindir + "/bdelta");
+		args.push_back(f1);
+		args.push_back(f2);
+		args.push_back(patch);
+		double t = launcher.run(args, rss);
+		if (t < 0) {
+			fprintf(stderr, "bdelta failed on %s\n", name.c_str());
+			return false;
+		}
+		bestDelta = std::min(bestDelta, t);
+		rssDelta = std::max(rssDelta, rss);
+
+		args[0] = bindir + "/bpatch";
+		args[2] = out;
+		args[3] = patch;
+		t = launcher.run(args, rss);
+		if (t < 0 || read_file(out) != read_file(f2)) {
+			fprintf(stderr, "bpatch failed on %s\n", name.c_str());
+			return false;
+		}
+		bestPatch = std::min(bestPatch, t);
+		rssPatch = std::max(rssPatch, rss);
+	}
+	double size2 = file_size(f2) / 1e6;
+	report("bdelta_" + name, size2 / bestDelta, "MB/s");
+	report("bdelta_rss_" + name, rssDelta / 1024.0, "MB");
+	report("bpatch_" + name, size2 / bestPatch, "MB/s");
+	report("bpatch_rss_" + name, rssPatch / 1024.0, "MB");
+	report("patch_size_" + name, file_size(patch), "bytes");
+	unlink(out.c_str());
+	return true;
+}
+
+// Prints each result of two runs' output with the change between them.
+static int compare(const char *oldPath, const char *newPath) {
+	std::map<std::string, double> old;
+	char name[256], unit[32];
+	double value;
+	FILE *f = fopen(oldPath, "r");
+	if (!f) {
+		fprintf(stderr, "couldn't open %s\n", oldPath);
+		return 1;
+	}
+	while (fscanf(f, "%255s %lf %31s", name, &value, unit) == 3)
+		old[name] = value;
+	fclose(f);
+	f = fopen(newPath, "r");
+	if (!f) {
+		fprintf(stderr, "couldn't open %s\n", newPath);
+		return 1;
+	}
+	while (fscanf(f, "%255s %lf %31s", name, &value, unit) == 3) {
+		std::map<std::string, double>::iterator o = old.find(name);
+		if (o == old.end() || o->second == 0)
+			printf("%-28s %14.3f %-6s\n", name, value, unit);
+		else
+			printf("%-28s %14.3f %-6s %+7.1f%%\n", name, value, unit, (value / o->second - 1) * 100);
+	}
+	fclose(f);
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	std::string corpusDir = "bench_corpus", bindir = ".";
+	unsigned scale = 32; // MB per corpus file
+	bool micro = true, tools = true;
+	while (argc > 1 && argv[1][0] == '-') {
+		if (strcmp(argv[1], "--compare") == 0 && argc == 4)
+			return compare(argv[2], argv[3]);
+		else if (strcmp(argv[1], "--corpus") == 0 && argc > 2) {
+			corpusDir = argv[2];
+			--argc;
+			++argv;
+		} else if (strcmp(argv[1], "--bin-dir") == 0 && argc > 2) {
+			bindir = argv[2];
+			--argc;
+			++argv;
+		} else if (strcmp(argv[1], "--scale") == 0 && argc > 2) {
+			scale = atoi(argv[2]);
+			if (!scale) scale = 1;
+			--argc;
+			++argv;
+		} else if (strcmp(argv[1], "--no-micro") == 0)
+			micro = false;
+		else if (strcmp(argv[1], "--no-tools") == 0)
+			tools = false;
+		else
+			break;
+		--argc;
+		++argv;
+	}
+	if (argc != 1) {
+		printf("usage: bdelta_bench [--corpus <dir>] [--bin-dir <dir>] [--scale <MB>] [--no-micro] [--no-tools]\n");
+		printf("       bdelta_bench --compare <old output> <new output>\n");
+		return 1;
+	}
+
+	if (tools) launcher.start();
+
+	// Each scale has a corpus of its own.
+	char sub[32];
+	snprintf(sub, sizeof(sub), "/%uM", scale);
+	mkdir(corpusDir.c_str(), 0777);
+	corpusDir += sub;
+	make_corpus(corpusDir, (size_t)scale << 20);
+
+	if (micro) {
+		Bytes data = read_file(corpusDir + "/random.1");
+		bench_hash<BasicPolynomialHash<uint8_t, 997> >("polynomial_997", data, 997);
+		bench_hash<PolynomialHash<uint8_t> >("polynomial_31", data, 31);
+		bench_hash<BuzHash<uint8_t> >("buzhash_31", data, 31);
+		bench_hash<Crc32cHash<uint8_t> >("crc32c_31", data, 31);
+		bench_compare(data.size());
+		bench_index(1 << 20);
+		for (unsigned i = 0; i < corpusSize; ++i) {
+			Bytes f1 = read_file(corpusDir + "/" + corpus[i].name + ".1"),
+			      f2 = read_file(corpusDir + "/" + corpus[i].name + ".2");
+			bench_pass(corpus[i].name, f1, f2, 997);
+			bench_pass(corpus[i].name, f1, f2, 31);
+		}
+	}
+	if (tools)
+		for (unsigned i = 0; i < corpusSize; ++i)
+			if (!bench_tools(bindir, corpusDir + "/" + corpus[i].name, corpus[i].name))
+				return 1;
+	return 0;
+}
@@ -0,0 +1,129 @@
+#!/bin/sh
+# Any copyright is dedicated to the Public Domain.
+# http://creativecommons.org/publicdomain/zero/1.0/
+
+# Round trips through bdelta and bpatch, run by "make check" in src/.
+# The first argument is the directory holding the tools.
+
+bin=${1:-.}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+fail() {
+	echo "FAIL: $1"
+	failed=1
+}
+
+# A reference, and a new file made of moved and changed parts of it.
+head -c 300000 /dev/urandom > "$dir/old"
+{ tail -c 100000 "$dir/old"; echo inserted; head -c 150000 "$dir/old"; head -c 5000 /dev/urandom; } > "$dir/new"
+
+# --batch, in every input mode
+for mode in --mmap --no-mmap --all-in-ram; do
+	printf '%s\t%s\t%s\n' "$dir/old" "$dir/new" "$dir/p1" "$dir/new" "$dir/old" "$dir/p2" > "$dir/manifest"
+	"$bin/bdelta" $mode -j 2 --batch "$dir/manifest" > /dev/null || fail "bdelta $mode --batch"
+	"$bin/bpatch" "$dir/old" "$dir/out" "$dir/p1" && cmp -s "$dir/out" "$dir/new" || fail "batch $mode, first job"
+	"$bin/bpatch" "$dir/new" "$dir/out" "$dir/p2" && cmp -s "$dir/out" "$dir/old" || fail "batch $mode, second job"
+done
+
+# Several references, with --ref, in every input mode and patch layout
+head -c 200000 /dev/urandom > "$dir/ref2"
+{ head -c 90000 "$dir/ref2"; tail -c 120000 "$dir/old"; tail -c 50000 "$dir/ref2"; } > "$dir/multi"
+for mode in --mmap --no-mmap --all-in-ram; do
+	for layout in "--patch-version 2" "--chunk-size 1"; do
+		"$bin/bdelta" $mode -j 2 $layout --ref "$dir/ref2" "$dir/old" "$dir/multi" "$dir/p" || fail "bdelta $mode $layout --ref"
+		"$bin/bpatch" --ref "$dir/ref2" "$dir/old" "$dir/out" "$dir/p" && cmp -s "$dir/out" "$dir/multi" || fail "--ref $mode $layout"
+	done
+done
+"$bin/bpatch" "$dir/old" "$dir/out" "$dir/p" 2> /dev/null && fail "bpatch without the second reference"
+
+# Each patch layout: version 1 and 2 records, and version 4 chunks, small
+# enough that the new file spans several
+for layout in "--patch-version 1" "--patch-version 2" "--chunk-size 1"; do
+	"$bin/bdelta" $layout "$dir/old" "$dir/new" "$dir/p" || fail "bdelta $layout"
+	"$bin/bpatch" "$dir/old" "$dir/out" "$dir/p" && cmp -s "$dir/out" "$dir/new" || fail "$layout round trip"
+done
+"$bin/bdelta" --patch-version 1 "$dir/old" "$dir/new" "$dir/p"
+[ "$(od -A n -j 5 -N 1 -t u1 "$dir/p" | tr -d ' ')" = 4 ] || fail "small version 1 patch doesn't use 4-byte integers"
+"$bin/bdelta" --chunk-size 1 "$dir/new" "$dir/old" "$dir/p" || fail "bdelta --chunk-size, backwards"
+"$bin/bpatch" "$dir/new" "$dir/out" "$dir/p" && cmp -s "$dir/out" "$dir/old" || fail "--chunk-size round trip, backwards"
+
+# Version 3, for each codec bdelta was built with
+for codec in zstd lz4 zstd:19; do
+	if "$bin/bdelta" --compress $codec "$dir/old" "$dir/new" "$dir/p" > "$dir/msg" 2>&1; then
+		"$bin/bpatch" "$dir/old" "$dir/out" "$dir/p" && cmp -s "$dir/out" "$dir/new" || fail "--compress $codec round trip"
+	else
+		grep -q "built without" "$dir/msg" || fail "bdelta --compress $codec"
+	fi
+done
+
+# Version 1 with 8-byte integers, for an old file over 4 GB.  A sparse file
+# keeps it cheap; one pass of large blocks keeps the index small.
+if truncate -s 4300000000 "$dir/huge" 2> /dev/null; then
+	{ head -c 50000 "$dir/new"; head -c 100000 "$dir/huge"; } > "$dir/hnew"
+	"$bin/bdelta" --passes 4093:8186 --patch-version 1 "$dir/huge" "$dir/hnew" "$dir/p" || fail "bdelta over 4 GB"
+	[ "$(od -A n -j 5 -N 1 -t u1 "$dir/p" | tr -d ' ')" = 8 ] || fail "version 1 over 4 GB doesn't use 8-byte integers"
+	"$bin/bpatch" "$dir/huge" "$dir/out" "$dir/p" && cmp -s "$dir/out" "$dir/hnew" || fail "version 1 over 4 GB round trip"
+	rm -f "$dir/huge"
+fi
+
+# Options that pick conflicting patch versions
+for opts in "--patch-version 2 --chunk-size 1" "--patch-version 1 --compress zstd" "--compress zstd --chunk-size 1"; do
+	"$bin/bdelta" $opts "$dir/old" "$dir/new" "$dir/p" > /dev/null 2>&1 && fail "bdelta $opts"
+done
+
+# Sampling for --memory-limit must pick the same blocks with any number of
+# threads, so the matches are the same.
+head -c 2000000 /dev/urandom > "$dir/big"
+{ head -c 20000 "$dir/big"; head -c 1000000 /dev/urandom; tail -c 30000 "$dir/big"; } > "$dir/big2"
+for j in 1 4; do
+	"$bin/bdelta" --stats --memory-limit 1 -j $j "$dir/big" "$dir/big2" "$dir/pj$j" > "$dir/stats$j" || fail "bdelta --memory-limit -j $j"
+done
+grep -q '"sampledPasses": [1-9]' "$dir/stats1" || fail "--memory-limit didn't sample"
+for j in 1 4; do
+	grep -o '"blocks[A-Z][a-z]*": [0-9]*' "$dir/stats$j" > "$dir/blocks$j"
+done
+cmp -s "$dir/blocks1" "$dir/blocks4" || fail "--memory-limit indexes different blocks with -j 1 and -j 4"
+cmp -s "$dir/pj1" "$dir/pj4" || fail "--memory-limit patches differ with -j 1 and -j 4"
+
+# A new file that copies the start of the old one twice.  Every input mode
+# must give the same small patch; a prepass by default claimed the first
+# copy and left the second one to be stored literally.
+head -c 3000000 /dev/urandom > "$dir/dup1"
+{ head -c 1000000 "$dir/dup1"; echo hello; tail -c 1500000 "$dir/dup1"; head -c 20000 /dev/urandom; head -c 300000 "$dir/dup1"; } > "$dir/dup2"
+for mode in --mmap --no-mmap --all-in-ram; do
+	"$bin/bdelta" $mode "$dir/dup1" "$dir/dup2" "$dir/pd$mode" || fail "bdelta $mode, repeated copy"
+	[ $(wc -c < "$dir/pd$mode") -lt 30000 ] || fail "bdelta $mode stores a repeated copy literally"
+done
+cmp -s "$dir/pd--mmap" "$dir/pd--no-mmap" && cmp -s "$dir/pd--mmap" "$dir/pd--all-in-ram" || fail "input modes give different patches"
+
+# Version 4 features, on a new file of several 1 MB chunks: bpatch -j,
+# --range across a chunk boundary, and --range to stdout
+"$bin/bdelta" --chunk-size 1 "$dir/dup1" "$dir/dup2" "$dir/pc" || fail "bdelta --chunk-size, several chunks"
+"$bin/bpatch" -j 3 "$dir/dup1" "$dir/out" "$dir/pc" && cmp -s "$dir/out" "$dir/dup2" || fail "bpatch -j 3"
+tail -c +1500001 "$dir/dup2" | head -c 1000000 > "$dir/part"
+"$bin/bpatch" --range 1500000:1000000 "$dir/dup1" "$dir/out" "$dir/pc" && cmp -s "$dir/out" "$dir/part" || fail "bpatch --range"
+"$bin/bpatch" -j 2 --range 1500000:1000000 "$dir/dup1" - "$dir/pc" > "$dir/out" && cmp -s "$dir/out" "$dir/part" || fail "bpatch --range to stdout"
+
+# Pipes: the new file from stdin in bdelta, and the patch from stdin and
+# the new file to stdout in bpatch, for a plain and a chunked patch
+"$bin/bdelta" "$dir/dup1" - "$dir/pp" < "$dir/dup2" || fail "bdelta from stdin"
+"$bin/bpatch" "$dir/dup1" "$dir/out" "$dir/pp" && cmp -s "$dir/out" "$dir/dup2" || fail "bdelta from stdin round trip"
+for patch in pp pc; do
+	"$bin/bpatch" "$dir/dup1" "$dir/out" - < "$dir/$patch" && cmp -s "$dir/out" "$dir/dup2" || fail "bpatch $patch from stdin"
+	"$bin/bpatch" "$dir/dup1" - "$dir/$patch" > "$dir/out" && cmp -s "$dir/out" "$dir/dup2" || fail "bpatch $patch to stdout"
+	cat "$dir/$patch" | "$bin/bpatch" "$dir/dup1" - - | cmp -s - "$dir/dup2" || fail "bpatch $patch through pipes"
+done
+# --signature: a patch made from a saved signature of the old file applies,
+# and is as small as one made from the file; other signatures are refused.
+"$bin/bdelta" --make-signature "$dir/dup1" "$dir/sig" || fail "bdelta --make-signature"
+"$bin/bdelta" --signature "$dir/sig" "$dir/dup1" "$dir/dup2" "$dir/ps" || fail "bdelta --signature"
+"$bin/bpatch" "$dir/dup1" "$dir/out" "$dir/ps" && cmp -s "$dir/out" "$dir/dup2" || fail "--signature round trip"
+[ $(wc -c < "$dir/ps") -lt 30000 ] || fail "bdelta --signature stores a repeated copy literally"
+"$bin/bdelta" --signature "$dir/sig" "$dir/old" "$dir/new" "$dir/p" > /dev/null && fail "bdelta --signature of another file"
+head -c 1000 /dev/urandom > "$dir/badsig"
+"$bin/bdelta" --signature "$dir/badsig" "$dir/dup1" "$dir/dup2" "$dir/p" > /dev/null && fail "bdelta --signature of a bad signature file"
+
+[ $failed = 0 ] && echo "all checks passed"
+exit $failed
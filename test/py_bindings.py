@@ -16,3 +16,14 @@ print list(b.matches()) # [(0, 0, 10), (15, 17, 29)]
 
 b.b_pass(2, 3, 0) # Find all matches that are at least 3 chars long
 print list(b.matches()) # [(0, 0, 10), (11, 11, 4), (15, 17, 29)]
+
+p1, p2, num = b.match_arrays() # The same matches as three memoryviews, fetched in one call
+print list(zip(p1, p2, num)) # [(0, 0, 10), (11, 11, 4), (15, 17, 29)]
+
+stats = b.stats() # Totals, and a dict per pass of what it did
+print stats['numPasses'], [p['matchesAdded'] for p in stats['passes']] # 3 [1, 1, 1]
+
+# Anything supporting the buffer protocol is diffed in place, without copying;
+# bytes compare in 1-byte tokens, array('I') or numpy uint32 arrays in 4-byte ones.
+import bdelta
+print bdelta.diff(b"The quick brown fox jumped over the lazy dog", b"The quick drowned fox jumped over the lazy dog", [(13, 27), (3, 5), (2, 3)]) # [(0, 0, 10), (11, 11, 4), (15, 17, 29)]